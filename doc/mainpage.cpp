@@ -19,6 +19,7 @@
  * ## Requirements
  * 
  *   - [libzip](http://www.nih.at/libzip),
+ *   - [zlib](https://zlib.net), already required by libzip,
  *   - C++14.
  * 
  * ## Installation
@@ -16,6 +16,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <cctype>
+#include <fstream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
 #include <gtest/gtest.h>
 
 #include <zip.hpp>
@@ -75,6 +82,42 @@ TEST(sources, buffer)
     }
 }
 
+#if !defined(_WIN32)
+
+TEST(sources, mmap)
+{
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+        archive.add(source_mmap(DIRECTORY "data.txt"), "data.txt");
+        archive.add(source_mmap(DIRECTORY "data.txt", 2, 3), "range.txt");
+        archive.add(source_mmap(DIRECTORY "data.txt", 7), "empty.txt");
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ("abcdef\n", archive.open("data.txt").read(archive.stat("data.txt").size));
+        ASSERT_EQ("cde", archive.open("range.txt").read(archive.stat("range.txt").size));
+        ASSERT_EQ(0U, archive.stat("empty.txt").size);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip", ZIP_TRUNCATE);
+        archive.add(source_mmap(DIRECTORY "data.txt", 8), "data.txt");
+
+        FAIL() << "exception expected";
+    } catch (const std::exception &) {
+    }
+}
+
+#endif
+
 /*
  * Write.
  * ------------------------------------------------------------------
@@ -123,6 +166,36 @@ TEST(write, notexist)
     }
 }
 
+TEST(write, estimate)
+{
+    std::string text;
+
+    for (int i = 0; i < 100000; ++i)
+        text += "line " + std::to_string(i % 5000) + "\n";
+
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+
+        archive.enable_estimate();
+        archive.add(source_buffer(text), "text");
+        archive.add(source_buffer(text), "stored");
+        archive.set_file_compression(1, ZIP_CM_STORE);
+
+        auto estimate = archive.estimate();
+
+        ASSERT_LT(0U, estimate.sampled);
+        ASSERT_EQ(0U, estimate.unknown);
+        ASSERT_LE(estimate.size_low, estimate.size);
+        ASSERT_GE(estimate.size_high, estimate.size);
+        ASSERT_LT(text.size(), estimate.size);
+        ASSERT_GT(2 * text.size(), estimate.size);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
 /*
  * Reading.
  * ------------------------------------------------------------------
@@ -285,6 +358,1190 @@ TEST_F(reading_test, loop)
     }
 }
 
+/*
+ * Merge.
+ * ------------------------------------------------------------------
+ */
+
+namespace {
+
+void make_archive(const std::string& path, const std::vector<std::pair<std::string, std::string>>& entries)
+{
+    remove(path.c_str());
+
+    archive archive(path, ZIP_CREATE);
+
+    for (const auto& e : entries)
+        archive.add(source_buffer(e.second), e.first);
+}
+
+std::string read_entry(archive& archive, const std::string& name)
+{
+    return archive.open(name).read(archive.stat(name).size);
+}
+
+} // !namespace
+
+TEST(merge, simple)
+{
+    make_archive("merge1.zip", {{"a.txt", "alpha"}, {"same.txt", "first"}});
+    make_archive("merge2.zip", {{"b.txt", "beta"}, {"same.txt", "second"}});
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+        archive.merge({"merge1.zip", "merge2.zip"}, merge_policy::keep_last);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ(static_cast<int64_t>(3), archive.num_entries());
+        ASSERT_STREQ("a.txt", archive.stat(0).name);
+        ASSERT_STREQ("same.txt", archive.stat(1).name);
+        ASSERT_STREQ("b.txt", archive.stat(2).name);
+        ASSERT_EQ("alpha", read_entry(archive, "a.txt"));
+        ASSERT_EQ("beta", read_entry(archive, "b.txt"));
+        ASSERT_EQ("second", read_entry(archive, "same.txt"));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(merge, conflict)
+{
+    make_archive("merge1.zip", {{"same.txt", "first"}});
+    make_archive("merge2.zip", {{"same.txt", "second"}});
+    remove("output.zip");
+
+    {
+        archive archive("output.zip", ZIP_CREATE);
+
+        ASSERT_THROW(archive.merge({"merge1.zip", "merge2.zip"}), std::runtime_error);
+        archive.unchange_all();
+    }
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+        archive.merge({"merge1.zip", "merge2.zip"}, merge_policy::keep_first);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    archive archive("output.zip");
+
+    ASSERT_EQ("first", read_entry(archive, "same.txt"));
+}
+
+TEST(merge, preload)
+{
+    make_archive("output.zip", {{"same.txt", "old"}});
+    make_archive("merge2.zip", {{"same.txt", "second"}});
+
+    try {
+        archive archive("output.zip");
+        preload_policy policy;
+
+        policy.names = {"same.txt"};
+        archive.preload(policy);
+        archive.wait_preload();
+
+        ASSERT_EQ(1U, archive.preload_status().loaded);
+
+        archive.merge({"merge2.zip"}, merge_policy::keep_last);
+
+        ASSERT_EQ(0U, archive.preload_status().loaded);
+        ASSERT_EQ(0U, archive.preload_status().bytes);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ("second", read_entry(archive, "same.txt"));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(merge, move)
+{
+    make_archive("merge1.zip", {{"a.txt", "alpha"}});
+    remove("output.zip");
+    remove("output2.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+
+        archive.merge({"merge1.zip"});
+
+        // The merge must be written before the source is released.
+        archive = libzip::archive("output2.zip", ZIP_CREATE);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    archive archive("output.zip");
+
+    ASSERT_EQ("alpha", read_entry(archive, "a.txt"));
+}
+
+TEST(merge, encoding)
+{
+    remove("merge1.zip");
+    remove("output.zip");
+
+    try {
+        archive archive("merge1.zip", ZIP_CREATE);
+
+        archive.add(source_buffer("a"), "caf\x82.txt", ZIP_FL_ENC_CP437);
+        archive.add(source_buffer("b"), "caf\xc3\xa9.txt", ZIP_FL_ENC_UTF_8);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+        archive.merge({"merge1.zip"});
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    archive archive("output.zip");
+
+    ASSERT_EQ(1U, archive.enable_strict_utf8().size());
+    ASSERT_STREQ("caf\x82.txt", archive.name(0));
+    ASSERT_STREQ("caf\xc3\xa9.txt", archive.name(1));
+}
+
+/*
+ * Bulk operations.
+ * ------------------------------------------------------------------
+ */
+
+TEST(bulk, simple)
+{
+    make_archive("output.zip", {{"a.tmp", "a"}, {"b.txt", "b"}, {"c.tmp", "c"}, {"d.txt", "d"}});
+
+    try {
+        archive archive("output.zip");
+
+        auto removed = archive.remove_if(glob("*.tmp"));
+
+        ASSERT_EQ(2U, removed.applied);
+        ASSERT_TRUE(removed.errors.empty());
+
+        // Both are renamed to the same name, the second one fails.
+        auto renamed = archive.rename_if(glob("*.txt"), [] (uint64_t, const std::string&) {
+            return std::string("same.txt");
+        });
+
+        ASSERT_EQ(1U, renamed.applied);
+        ASSERT_EQ(1U, renamed.errors.size());
+        ASSERT_EQ(3U, renamed.errors[0].index);
+
+        auto compressed = archive.set_compression_if([] (uint64_t index, const std::string&) {
+            return index == 3;
+        }, ZIP_CM_STORE);
+
+        ASSERT_EQ(1U, compressed.applied);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ(2, archive.num_entries());
+        ASSERT_TRUE(archive.exists("same.txt"));
+        ASSERT_TRUE(archive.exists("d.txt"));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Transform.
+ * ------------------------------------------------------------------
+ */
+
+TEST(transform, simple)
+{
+    make_archive("input.zip", {{"a.txt", "alpha"}, {"b.bin", "beta"}, {"c.txt", "secret"}, {"d.txt", "delta"}});
+    remove("output.zip");
+
+    {
+        archive archive("input.zip");
+
+        archive.set_file_compression(3, ZIP_CM_STORE);
+    }
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+        transform_options options;
+
+        options.filter = [] (const libzip::stat& st) {
+            return std::string(st.name).find(".txt") != std::string::npos;
+        };
+        options.max_memory = 8;
+        options.concurrency = 2;
+
+        archive.transform("input.zip", [] (const libzip::stat& st, std::string& content) {
+            if (std::string(st.name) == "c.txt")
+                return false;
+
+            for (auto& c : content)
+                c = static_cast<char>(std::toupper(c));
+
+            return true;
+        }, options);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ(3, archive.num_entries());
+        ASSERT_EQ("a.txt", std::string(archive.stat(0).name));
+        ASSERT_EQ("ALPHA", read_entry(archive, "a.txt"));
+        ASSERT_EQ("beta", read_entry(archive, "b.bin"));
+        ASSERT_EQ("DELTA", read_entry(archive, "d.txt"));
+        ASSERT_EQ(ZIP_CM_STORE, archive.stat("d.txt").comp_method);
+        ASSERT_EQ(ZIP_CM_DEFLATE, archive.stat("a.txt").comp_method);
+        ASSERT_EQ(crc32(0, reinterpret_cast<const Bytef*>("ALPHA"), 5), archive.stat("a.txt").crc);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Search.
+ * ------------------------------------------------------------------
+ */
+
+TEST(search, simple)
+{
+    // Put a match across the 64 KiB read chunks.
+    auto big = std::string(65534, 'x') + "needle" + std::string(10, 'x');
+
+    make_archive("output.zip", {
+        {"a.log", "one needle, two needle"},
+        {"b.log", "nothing here"},
+        {"c.log", big}
+    });
+
+    try {
+        archive archive("output.zip");
+
+        auto hits = archive.search("needle");
+
+        ASSERT_EQ(3U, hits.size());
+        ASSERT_EQ(0U, hits[0].index);
+        ASSERT_EQ(4U, hits[0].offset);
+        ASSERT_EQ(0U, hits[1].index);
+        ASSERT_EQ(16U, hits[1].offset);
+        ASSERT_EQ(2U, hits[2].index);
+        ASSERT_EQ(65534U, hits[2].offset);
+
+        hits = archive.search("needle", true);
+
+        ASSERT_EQ(2U, hits.size());
+        ASSERT_EQ(0U, hits[0].index);
+        ASSERT_EQ(2U, hits[1].index);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(search, pending)
+{
+    make_archive("output.zip", {{"a.log", "needle"}, {"b.log", "needle"}});
+
+    try {
+        archive archive("output.zip");
+
+        archive.remove(0);
+
+        auto hits = archive.search("needle");
+
+        ASSERT_EQ(1U, hits.size());
+        ASSERT_EQ(1U, hits[0].index);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Peek.
+ * ------------------------------------------------------------------
+ */
+
+TEST_F(reading_test, peek)
+{
+    try {
+        auto heads = m_archive.peek({3, 0}, 4);
+
+        ASSERT_EQ(2U, heads.size());
+        ASSERT_EQ("This", heads[1]);
+        ASSERT_EQ(4U, heads[0].size());
+
+        heads = m_archive.peek({0, 2}, 1000, 2);
+
+        ASSERT_EQ("This is a test\n", heads[0]);
+        ASSERT_EQ("", heads[1]);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Preload.
+ * ------------------------------------------------------------------
+ */
+
+TEST_F(reading_test, preload)
+{
+    try {
+        preload_policy policy;
+
+        policy.patterns = {"doc/*"};
+        policy.names = {"README"};
+        m_archive.preload(policy);
+        m_archive.wait_preload();
+
+        auto status = m_archive.preload_status();
+
+        ASSERT_TRUE(status.done);
+        ASSERT_TRUE(status.error.empty());
+        ASSERT_EQ(3U, status.total);
+        ASSERT_EQ(3U, status.loaded);
+        ASSERT_EQ(45U, status.bytes);
+        ASSERT_EQ("This is a test\n", m_archive.open("README").read(15));
+        ASSERT_EQ("This is a test\n", m_archive.open(0).read(15));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Access traces.
+ * ------------------------------------------------------------------
+ */
+
+TEST_F(reading_test, trace)
+{
+    try {
+        m_archive.record("trace.bin");
+        m_archive.open("doc/REFMAN");
+        m_archive.open(0);
+        m_archive.open("INSTALL");
+        m_archive.stop_recording();
+
+        ASSERT_EQ(std::vector<uint64_t>({3, 0, 1}), read_trace("trace.bin"));
+
+        m_archive.prefetch("trace.bin");
+        m_archive.wait_prefetch();
+
+        auto status = m_archive.prefetch_status();
+
+        ASSERT_TRUE(status.done);
+        ASSERT_EQ(3U, status.entries);
+        ASSERT_LE(1U, status.ranges);
+        ASSERT_LE(m_archive.stat(0).comp_size + m_archive.stat(1).comp_size + m_archive.stat(3).comp_size, status.bytes);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Concurrent reads.
+ * ------------------------------------------------------------------
+ */
+
+TEST(concurrent, read)
+{
+    std::string text;
+
+    for (int i = 0; i < 10000; ++i)
+        text += "line " + std::to_string(i) + "\n";
+
+    make_archive("output.zip", {{"text", text}, {"small", "abc"}});
+
+    try {
+        archive archive("output.zip");
+
+        archive.enable_concurrent_reads();
+
+        ASSERT_EQ(static_cast<int64_t>(2), archive.num_entries());
+        ASSERT_EQ(static_cast<int64_t>(1), archive.find("small"));
+        ASSERT_FALSE(archive.exists("none"));
+        ASSERT_EQ(text.size(), archive.stat("text").size);
+
+        std::vector<std::thread> threads;
+        std::atomic<int> errors{0};
+
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] () {
+                for (int i = 0; i < 20; ++i) {
+                    if (archive.open("text").read(text.size()) != text)
+                        ++ errors;
+                    if (archive.open(1).read(3) != "abc")
+                        ++ errors;
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        ASSERT_EQ(0, errors);
+        ASSERT_ANY_THROW(archive.add(source_buffer("x"), "x"));
+        ASSERT_ANY_THROW(archive.rename(1, "other"));
+        ASSERT_ANY_THROW(archive.remove(1));
+        ASSERT_ANY_THROW(archive.set_file_compression(1, ZIP_CM_STORE));
+        ASSERT_ANY_THROW(archive.set_comment("comment"));
+        ASSERT_ANY_THROW(archive.unchange_all());
+        ASSERT_ANY_THROW(archive.set_flag(ZIP_AFL_RDONLY, 1));
+        ASSERT_EQ(static_cast<int64_t>(2), archive.num_entries());
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(concurrent, executor)
+{
+    class counting : public thread_pool {
+    public:
+        std::atomic<int> submitted{0};
+
+        counting()
+            : thread_pool(2)
+        {
+        }
+
+        void submit(std::function<void ()> task) override
+        {
+            ++ submitted;
+            thread_pool::submit(std::move(task));
+        }
+    };
+
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    for (int i = 0; i < 16; ++i)
+        entries.emplace_back("file" + std::to_string(i), i % 2 ? "needle" : "hay");
+
+    make_archive("output.zip", entries);
+
+    try {
+        auto pool = std::make_shared<counting>();
+        archive archive("output.zip");
+
+        archive.set_executor(pool);
+
+        auto hits = archive.search("needle", true, 4);
+
+        ASSERT_EQ(8U, hits.size());
+
+        for (std::size_t i = 0; i < hits.size(); ++i)
+            ASSERT_EQ(i * 2 + 1, hits[i].index);
+
+        ASSERT_GT(pool->submitted, 0);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+#if !defined(_WIN32)
+
+/*
+ * Sorted central directory.
+ * ------------------------------------------------------------------
+ */
+
+TEST(sorted, directory)
+{
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+
+        archive.enable_sorted_directory();
+        archive.add(source_buffer("z"), "zeta");
+        archive.add(source_buffer("b"), "beta/one");
+        archive.add(source_buffer("a"), "alpha");
+        archive.add(source_buffer("B"), "Beta");
+        archive.close();
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_STREQ("Beta", archive.name(0));
+        ASSERT_STREQ("alpha", archive.name(1));
+        ASSERT_STREQ("beta/one", archive.name(2));
+        ASSERT_STREQ("zeta", archive.name(3));
+        ASSERT_EQ(13U, archive.file_extra_field(0, 0x5a53, ZIP_FL_CENTRAL).size());
+
+        archive.enable_concurrent_reads();
+
+        ASSERT_EQ(0, archive.find("Beta"));
+        ASSERT_EQ(2, archive.find("beta/one"));
+        ASSERT_EQ(3, archive.find("zeta"));
+        ASSERT_FALSE(archive.exists("beta"));
+        ASSERT_EQ("b", archive.open("beta/one").read(1));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    // Unchanged and already sorted, nothing is written.
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+    struct ::stat sb;
+
+    ASSERT_EQ(0, ::utimensat(AT_FDCWD, "output.zip", times, 0));
+
+    try {
+        archive archive("output.zip");
+
+        archive.enable_sorted_directory();
+        archive.close();
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    ASSERT_EQ(0, ::stat("output.zip", &sb));
+    ASSERT_EQ(1000000000, sb.st_mtime);
+}
+
+#endif
+
+/*
+ * I/O scheduling.
+ * ------------------------------------------------------------------
+ */
+
+TEST(io, scheduler)
+{
+    std::vector<std::pair<std::string, std::string>> entries;
+    std::mt19937 random(42);
+
+    // Random bytes do not compress, every entry costs 64 KiB of reads.
+    for (int i = 0; i < 8; ++i) {
+        std::string data(65536, '\0');
+
+        for (auto& ch : data)
+            ch = static_cast<char>(random());
+
+        entries.emplace_back("file" + std::to_string(i), data);
+    }
+
+    make_archive("output.zip", entries);
+
+    try {
+        auto io = std::make_shared<io_scheduler>(1U << 20, 65536);
+        archive background("output.zip");
+        archive interactive("output.zip");
+        std::atomic<bool> done{false};
+        int errors = 0;
+
+        background.set_io_scheduler(io);
+        interactive.set_io_scheduler(io);
+
+        std::thread bulk([&] () {
+            background.search("needle", false, 2);
+            done = true;
+        });
+
+        while (!done)
+            if (interactive.open("file0").read(65536) != entries[0].second)
+                ++ errors;
+
+        bulk.join();
+
+        auto metrics = io->metrics();
+
+        ASSERT_EQ(0, errors);
+        ASSERT_LE(entries.size() * 65536, metrics.background.bytes);
+        ASSERT_LT(0U, metrics.background.delayed);
+        ASSERT_LT(0U, metrics.interactive.requests);
+        ASSERT_GT(metrics.background.max_wait, metrics.interactive.max_wait);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Split archives.
+ * ------------------------------------------------------------------
+ */
+
+TEST(volumes, read)
+{
+    std::string text;
+
+    for (int i = 0; i < 1000; ++i)
+        text += "line " + std::to_string(i) + "\n";
+
+    make_archive("output.zip", {{"text", text}, {"small", "abc"}});
+
+    std::ifstream in("output.zip", std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::string> volumes{"output.z01", "output.z02", "output.z03"};
+
+    // Cut in the middle of the first entry and of the central directory.
+    std::ofstream(volumes[0], std::ios::binary) << data.substr(0, 100);
+    std::ofstream(volumes[1], std::ios::binary) << data.substr(100, data.size() - 150);
+    std::ofstream(volumes[2], std::ios::binary) << data.substr(data.size() - 50);
+
+    try {
+        auto archive = archive::open_volumes(volumes);
+
+        ASSERT_EQ(static_cast<int64_t>(2), archive.num_entries());
+        ASSERT_EQ(text, archive.open("text").read(text.size()));
+        ASSERT_EQ("abc", archive.open("small").read(3));
+
+        archive.enable_concurrent_reads();
+
+        ASSERT_EQ(text, archive.open("text").read(text.size()));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(volumes, embedded)
+{
+    make_archive("output.zip", {{"a.txt", "alpha"}});
+
+    std::ifstream in("output.zip", std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::ofstream("output.bin", std::ios::binary) << "header" << data;
+
+    try {
+        auto range = find_embedded("output.bin");
+
+        ASSERT_EQ(6U, range.offset);
+        ASSERT_EQ(data.size(), range.length);
+
+        archive archive("output.bin", range);
+
+        ASSERT_EQ("alpha", archive.open("a.txt").read(5));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Strict UTF-8.
+ * ------------------------------------------------------------------
+ */
+
+TEST(utf8, strict)
+{
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+
+        archive.add(source_buffer("a"), "caf\xc3\xa9.txt", ZIP_FL_ENC_UTF_8);
+        archive.add(source_buffer("b"), "caf\x82.txt", ZIP_FL_ENC_CP437);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ(std::vector<uint64_t>({1}), archive.enable_strict_utf8());
+        ASSERT_STREQ("caf\xc3\xa9.txt", archive.name(0));
+        ASSERT_STREQ("caf\x82.txt", archive.name(1));
+        ASSERT_EQ(static_cast<int64_t>(0), archive.find("caf\xc3\xa9.txt"));
+        ASSERT_STREQ("caf\x82.txt", archive.begin()[1].name);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        // Deleted but not written yet.
+        archive.remove(1);
+
+        ASSERT_TRUE(archive.enable_strict_utf8().empty());
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Extra fields.
+ * ------------------------------------------------------------------
+ */
+
+TEST(extra, tables)
+{
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+
+        archive.add(source_buffer("a"), "a");
+        archive.add(source_buffer("b"), "b");
+
+        // mtime only, 1000000000.
+        archive.set_file_extra_field(1, 0x5455, std::string("\x01\x00\xca\x9a\x3b", 5));
+        // uid 1000 on 2 bytes, gid 100 on 4 bytes.
+        archive.set_file_extra_field(0, 0x7875, std::string("\x01\x02\xe8\x03\x04\x64\x00\x00\x00", 9));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        auto fields = archive.extra_fields(0x5455);
+
+        ASSERT_EQ(1U, fields.size());
+        ASSERT_EQ(1U, fields[0].index);
+        ASSERT_EQ(5U, fields[0].size);
+        ASSERT_EQ(std::string("\x01\x00\xca\x9a\x3b", 5), archive.file_extra_field(1, 0x5455));
+
+        auto times = archive.timestamps();
+
+        ASSERT_EQ(std::vector<uint64_t>({1}), times.index);
+        ASSERT_EQ(std::vector<int64_t>({1000000000}), times.mtime);
+        ASSERT_EQ(std::vector<int64_t>({-1}), times.atime);
+
+        auto owners = archive.owners();
+
+        ASSERT_EQ(std::vector<uint64_t>({0}), owners.index);
+        ASSERT_EQ(std::vector<uint64_t>({1000}), owners.uid);
+        ASSERT_EQ(std::vector<uint64_t>({100}), owners.gid);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Diff.
+ * ------------------------------------------------------------------
+ */
+
+TEST(diff, simple)
+{
+    make_archive("merge1.zip", {{"same", "same"}, {"changed", "old"}, {"removed", "x"}});
+    make_archive("merge2.zip", {{"same", "same"}, {"changed", "new"}, {"added", "y"}});
+
+    try {
+        archive from("merge1.zip");
+        archive to("merge2.zip");
+
+        for (auto verify : {false, true}) {
+            auto changes = diff(from, to, verify);
+
+            ASSERT_EQ(4U, changes.size());
+            ASSERT_EQ("same", changes[0].name);
+            ASSERT_EQ(diff_kind::unchanged, changes[0].kind);
+            ASSERT_EQ("changed", changes[1].name);
+            ASSERT_EQ(diff_kind::modified, changes[1].kind);
+            ASSERT_EQ("added", changes[2].name);
+            ASSERT_EQ(diff_kind::added, changes[2].kind);
+            ASSERT_EQ(-1, changes[2].from);
+            ASSERT_EQ("removed", changes[3].name);
+            ASSERT_EQ(diff_kind::removed, changes[3].kind);
+            ASSERT_EQ(2, changes[3].from);
+        }
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(diff, deleted)
+{
+    make_archive("merge1.zip", {{"same", "same"}, {"removed", "x"}});
+    make_archive("merge2.zip", {{"same", "same"}, {"added", "y"}});
+
+    try {
+        archive from("merge1.zip");
+        archive to("merge2.zip");
+
+        // Deleted but not written yet.
+        from.remove(1);
+        to.remove(1);
+
+        auto changes = diff(from, to);
+
+        ASSERT_EQ(1U, changes.size());
+        ASSERT_EQ("same", changes[0].name);
+        ASSERT_EQ(diff_kind::unchanged, changes[0].kind);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+/*
+ * Patch.
+ * ------------------------------------------------------------------
+ */
+
+TEST(patch, roundtrip)
+{
+    std::string text;
+
+    for (int i = 0; i < 5000; ++i)
+        text += "line " + std::to_string(i) + "\n";
+
+    auto changed = text;
+
+    changed.replace(1000, 4, "LINE");
+    changed += "appended\n";
+
+    make_archive("merge1.zip", {{"same", "same"}, {"text", text}, {"removed", "x"}});
+    make_archive("merge2.zip", {{"same", "same"}, {"text", changed}, {"added", "y"}});
+    remove("output.zip");
+
+    try {
+        archive from("merge1.zip");
+        archive to("merge2.zip");
+
+        make_patch(from, to, "patch.bin");
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive output("output.zip", ZIP_CREATE);
+
+        output.apply_patch("merge1.zip", "patch.bin");
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        ASSERT_EQ(static_cast<int64_t>(3), archive.num_entries());
+        ASSERT_EQ("same", read_entry(archive, "same"));
+        ASSERT_EQ(changed, read_entry(archive, "text"));
+        ASSERT_EQ("y", read_entry(archive, "added"));
+        ASSERT_FALSE(archive.exists("removed"));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(patch, corrupted)
+{
+    make_archive("merge1.zip", {{"same", "same"}});
+    make_archive("merge2.zip", {{"same", "same"}, {"added", "content"}});
+
+    try {
+        archive from("merge1.zip");
+        archive to("merge2.zip");
+
+        make_patch(from, to, "patch.bin");
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    std::ostringstream out;
+
+    out << std::ifstream("patch.bin", std::ios::binary).rdbuf();
+
+    auto data = out.str();
+
+    // Whole content not matching its CRC, then cut before its end.
+    for (auto size : {data.size(), data.size() - 3}) {
+        auto copy = data.substr(0, size);
+
+        copy.back() ^= 1;
+        std::ofstream("patch.bin", std::ios::binary | std::ios::trunc) << copy;
+        remove("output.zip");
+
+        archive output("output.zip", ZIP_CREATE);
+
+        ASSERT_ANY_THROW(output.apply_patch("merge1.zip", "patch.bin"));
+        output.unchange_all();
+    }
+}
+
+/*
+ * Extraction.
+ * ------------------------------------------------------------------
+ */
+
+#if !defined(_WIN32)
+
+namespace {
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+
+    out << in.rdbuf();
+
+    return out.str();
+}
+
+} // !namespace
+
+TEST(extract, incremental)
+{
+    make_archive("output.zip", {{"a.txt", "alpha"}, {"dir/b.txt", "beta"}});
+
+    try {
+        archive archive("output.zip");
+
+        auto result = archive.extract("extract");
+
+        ASSERT_EQ(2U, result.extracted);
+        ASSERT_EQ("alpha", read_file("extract/a.txt"));
+        ASSERT_EQ("beta", read_file("extract/dir/b.txt"));
+
+        extract_options options;
+
+        options.incremental = true;
+        result = archive.extract("extract", options);
+
+        ASSERT_EQ(0U, result.extracted);
+        ASSERT_EQ(2U, result.skipped);
+
+        // Same size, different content.
+        std::ofstream("extract/a.txt") << "ALPHA";
+
+        result = archive.extract("extract", options);
+
+        ASSERT_EQ(1U, result.extracted);
+        ASSERT_EQ(1U, result.skipped);
+        ASSERT_EQ("alpha", read_file("extract/a.txt"));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(extract, pending)
+{
+    make_archive("output.zip", {{"a.txt", "alpha"}, {"b.txt", "beta"}});
+
+    try {
+        archive archive("output.zip");
+
+        archive.rename(0, "renamed.txt");
+        archive.remove(1);
+
+        auto result = archive.extract("extract-pending");
+
+        ASSERT_EQ(1U, result.extracted);
+        ASSERT_EQ("alpha", read_file("extract-pending/renamed.txt"));
+        ASSERT_FALSE(std::ifstream("extract-pending/b.txt").good());
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(extract, sparse)
+{
+    auto image = std::string(1U << 20, '\0');
+
+    image.replace(100000, 4, "data");
+    make_archive("output.zip", {{"disk.img", image}, {"a.txt", "alpha"}});
+
+    try {
+        archive archive("output.zip");
+        extract_options options;
+
+        options.sparse = true;
+
+        auto result = archive.extract("extract", options);
+
+        ASSERT_EQ(2U, result.extracted);
+        ASSERT_EQ(image.size() + 5, result.logical);
+        ASSERT_EQ(4096U + 5, result.written);
+        ASSERT_EQ(image, read_file("extract/disk.img"));
+        ASSERT_EQ("alpha", read_file("extract/a.txt"));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+#if defined(__linux__)
+
+TEST(extract, memfd)
+{
+    std::string text;
+
+    for (int i = 0; i < 10000; ++i)
+        text += "line " + std::to_string(i) + "\n";
+
+    remove("output.zip");
+
+    try {
+        archive archive("output.zip", ZIP_CREATE);
+
+        archive.add(source_buffer(text), "lib/stored.so");
+        archive.add(source_buffer(text), "deflated.so");
+        archive.set_file_compression(0, ZIP_CM_STORE);
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+
+    try {
+        archive archive("output.zip");
+
+        for (uint64_t i = 0; i < 2; ++i) {
+            auto fd = archive.to_memfd(i);
+            std::string content(text.size() + 1, '\0');
+
+            content.resize(::read(fd, &content[0], content.size()));
+
+            ASSERT_EQ(text, content);
+            ASSERT_TRUE(::fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE);
+            ASSERT_GT(0, ::write(fd, "x", 1));
+            ::close(fd);
+        }
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+#endif
+
+TEST(extract, journal)
+{
+    make_archive("output.zip", {{"a.txt", "alpha"}, {"b.txt", "beta"}});
+
+    try {
+        archive archive("output.zip");
+
+        archive.extract("journal");
+
+        {
+            // Previous run: a.txt completed, b.txt half written.
+            detail::journal log("journal.journal", "output.zip", 2);
+
+            log.complete(0);
+            log.checkpoint(1, 2);
+        }
+
+        std::ofstream("journal/b.txt") << "be";
+
+        extract_options options;
+
+        options.journal = true;
+
+        auto result = archive.extract("journal/", options);
+
+        ASSERT_EQ(1U, result.extracted);
+        ASSERT_EQ(1U, result.skipped);
+        ASSERT_EQ("beta", read_file("journal/b.txt"));
+        ASSERT_FALSE(std::ifstream("journal.journal").good());
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(extract, materialize)
+{
+    make_archive("output.zip", {{"a.txt", "alpha"}, {"b.txt", "beta"}});
+
+    try {
+        archive archive("output.zip");
+
+        archive.enable_cache("cache", 5);
+
+        auto a = archive.materialize(0);
+
+        ASSERT_EQ("alpha", read_file(a));
+        ASSERT_EQ(a, archive.materialize(0));
+
+        // Over the limit, a.txt is the least recently used.
+        auto b = archive.materialize(1);
+
+        ASSERT_EQ("beta", read_file(b));
+        ASSERT_FALSE(std::ifstream(a).good());
+        ASSERT_FALSE(std::ifstream(a + ".lock").good());
+
+        // A damaged file of the same size is extracted again.
+        ::chmod(b.c_str(), 0644);
+        std::ofstream(b) << "BETA";
+
+        ASSERT_EQ(b, archive.materialize(1));
+        ASSERT_EQ("beta", read_file(b));
+    } catch (const std::exception &ex) {
+        FAIL() << ex.what();
+    }
+}
+
+TEST(extract, blob_cache)
+{
+    std::string text;
+
+    for (int i = 0; i < 1000; ++i)
+        text += "line " + std::to_string(i) + "\n";
+
+    // Names of the blobs, without the lock files.
+    auto blobs = [] () {
+        std::set<std::string> names;
+        std::unique_ptr<DIR, int (*)(DIR*)> dir(::opendir("blobs"), ::closedir);
+
+        if (!dir)
+            return names;
+
+        while (auto ent = ::readdir(dir.get())) {
+            std::string name(ent->d_name);
+
+            if (name[0] != '.' && name.find('.') == std::string::npos)
+                names.insert(name);
+        }
+
+        return names;
+    };
+    std::set<std::string> first;
+
+    // The second archive is written from the blobs of the first one.
+    for (auto path : {"output.zip", "output2.zip"}) {
+        remove(path);
+
+        try {
+            archive archive(path, ZIP_CREATE);
+
+            archive.enable_blob_cache("blobs");
+            archive.add(source_buffer(text), "text");
+            archive.add(source_buffer("abc"), "small");
+        } catch (const std::exception &ex) {
+            FAIL() << ex.what();
+        }
+
+        try {
+            archive archive(path);
+
+            ASSERT_EQ(text, read_entry(archive, "text"));
+            ASSERT_EQ("abc", read_entry(archive, "small"));
+            ASSERT_EQ(ZIP_CM_DEFLATE, archive.stat("text").comp_method);
+            ASSERT_GT(text.size(), archive.stat("text").comp_size);
+        } catch (const std::exception &ex) {
+            FAIL() << ex.what();
+        }
+
+        // No new blob for the second archive.
+        if (first.empty())
+            first = blobs();
+        else
+            ASSERT_EQ(first, blobs());
+    }
+
+    ASSERT_LE(2U, first.size());
+}
+
+#endif
+
 int main(int argc, char **argv)
 {
     testing::InitGoogleTest(&argc, argv);
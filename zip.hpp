@@ -32,15 +32,48 @@
 #   endif
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if !defined(_WIN32)
+#   include <dirent.h>
+#   include <fcntl.h>
+#   include <sys/file.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#   include <sys/sendfile.h>
+#endif
 
 #include <zip.h>
+#include <zlib.h>
 
 /**
  * \brief The libzip namespace.
@@ -108,788 +141,7438 @@ using int64_t = zip_int64_t;
 using uint64_t = zip_uint64_t;
 
 /**
- * \brief Source creation for adding files.
- *
- * This function must be passed through archive::add, it will be called to
- * create the appropriate zip_source  * inside the function.
- *
- * The user should not call the function itself as it's the responsability of
- * libzip to destroy the zip_source structure.
+ * \brief Where the parallel operations run their work.
  *
- * \see source::buffer
- * \see source::file
- */
-using source = std::function<struct zip_source* (struct zip*)>;
-
-/**
- * \brief File for reading.
+ * Implement submit (and concurrency) to run the archive work on an
+ * application thread pool. Executors with a native bulk primitive may also
+ * override parallel_for.
  */
-class file {
-private:
-    std::unique_ptr<struct zip_file, int (*)(struct zip_file*)> handle_;
-
-    file(const file&) = delete;
-    file& operator=(const file&) = delete;
-
+class executor {
 public:
     /**
-     * Create a File with a zip_file structure.
-     *
-     * \param file the file ready to be used
+     * Virtual destructor defaulted.
      */
-    inline file(struct zip_file* file) noexcept
-        : handle_(file, zip_fclose)
-    {
-    }
+    virtual ~executor() = default;
 
     /**
-     * Move constructor defaulted.
+     * Run a task asynchronously. The task doesn't throw.
      *
-     * \param other the other File
+     * \param task the task
      */
-    file(file&& other) noexcept = default;
+    virtual void submit(std::function<void ()> task) = 0;
 
     /**
-     * Move operator defaulted.
+     * Get the number of tasks which can run at once.
      *
-     * \return *this
+     * \return the number of threads
      */
-    file& operator=(file&&) noexcept = default;
+    virtual unsigned concurrency() const noexcept = 0;
 
     /**
-     * Read some data.
+     * Call fn(slot, i) for every i in [0, count) with up to workers
+     * threads.
      *
-     * \param data the destination buffer
-     * \param length the length
-     * \return the number of bytes written or -1 on failure
+     * The slot is in [0, workers) and never used by two threads at once.
+     * The calling thread takes part in the work and only waits for the
+     * tasks which started, so it can be called from a task of this
+     * executor. The first exception thrown by fn stops the remaining items
+     * and is rethrown.
+     *
+     * \param count the number of items
+     * \param workers the maximum number of threads, at least 1
+     * \param fn the function
      */
-    inline int read(void* data, uint64_t length) noexcept
+    virtual void parallel_for(std::size_t count, unsigned workers, const std::function<void (unsigned, std::size_t)>& fn)
     {
-        return zip_fread(handle_.get(), data, length);
+        struct state {
+            std::atomic<std::size_t> next{0};
+            std::size_t count;
+            const std::function<void (unsigned, std::size_t)>* fn;
+            std::mutex mutex;
+            std::condition_variable done;
+            unsigned active{0};
+            unsigned slots{0};
+            std::exception_ptr error;
+        };
+
+        auto shared = std::make_shared<state>();
+
+        shared->count = count;
+        shared->fn = &fn;
+
+        auto run = [] (state& st, unsigned slot) {
+            for (std::size_t i; (i = st.next++) < st.count; ) {
+                try {
+                    (*st.fn)(slot, i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(st.mutex);
+
+                    if (!st.error)
+                        st.error = std::current_exception();
+
+                    st.next = st.count;
+                }
+            }
+        };
+
+        for (unsigned i = 1; i < workers && i < count; ++i) {
+            submit([shared, run] () {
+                unsigned slot;
+
+                {
+                    // Started too late, the state may already be abandoned by the caller.
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+
+                    if (shared->next >= shared->count)
+                        return;
+
+                    slot = ++ shared->slots;
+                    ++ shared->active;
+                }
+
+                run(*shared, slot);
+
+                std::lock_guard<std::mutex> lock(shared->mutex);
+
+                if (-- shared->active == 0)
+                    shared->done.notify_all();
+            });
+        }
+
+        run(*shared, 0);
+
+        std::unique_lock<std::mutex> lock(shared->mutex);
+
+        shared->done.wait(lock, [&] () {
+            return shared->active == 0;
+        });
+
+        if (shared->error)
+            std::rethrow_exception(shared->error);
+    }
+};
+
+/**
+ * \brief Work-stealing thread pool, the default executor.
+ *
+ * Each thread has its own queue: tasks submitted from a pool thread go to
+ * its queue and are taken back in LIFO order, the others are spread over
+ * the queues. Idle threads steal the oldest tasks of the other queues.
+ */
+class thread_pool : public executor {
+private:
+    struct queue {
+        std::mutex mutex;
+        std::deque<std::function<void ()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::atomic<std::size_t> pending_{0};
+    std::atomic<unsigned> next_{0};
+    bool stop_{false};
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // Pool and queue of the current thread.
+    static std::pair<const thread_pool*, unsigned>& current() noexcept
+    {
+        static thread_local std::pair<const thread_pool*, unsigned> value{nullptr, 0};
+
+        return value;
+    }
+
+    bool pop(unsigned self, std::function<void ()>& task)
+    {
+        for (unsigned k = 0; k < queues_.size(); ++k) {
+            auto& q = *queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+
+            if (q.tasks.empty())
+                continue;
+
+            if (k == 0) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+
+            -- pending_;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void run(unsigned self)
+    {
+        current() = {this, self};
+
+        for (std::function<void ()> task; ; ) {
+            if (pop(self, task)) {
+                try {
+                    task();
+                } catch (...) {
+                }
+
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            wakeup_.wait(lock, [this] () {
+                return stop_ || pending_ > 0;
+            });
+
+            if (stop_ && pending_ == 0)
+                return;
+        }
     }
 
+public:
     /**
-     * Read some data to a fixed size array.
+     * Start the threads.
      *
-     * \param data the array
-     * \return the number of bytes written or -1 on failure
+     * \param threads the number of threads, 0 for the hardware one
      */
-    template <size_t Size>
-    inline int read(char (&data)[Size]) noexcept
+    explicit thread_pool(unsigned threads = 0)
     {
-        return read(data, Size);
+        if (threads == 0)
+            threads = std::max(1U, std::thread::hardware_concurrency());
+
+        for (unsigned i = 0; i < threads; ++i)
+            queues_.emplace_back(new queue);
+        for (unsigned i = 0; i < threads; ++i)
+            threads_.emplace_back(&thread_pool::run, this, i);
     }
 
     /**
-     * Optimized function for reading all characters with only one allocation.
-     * Ideal for combining with archive::stat.
-     *
-     * \param length the length of the file
-     * \return the whole string
-     * \see archive::stat
+     * Run the remaining tasks and join the threads.
      */
-    std::string read(uint64_t length)
+    ~thread_pool()
     {
-        std::string result;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
 
-        result.resize(length);
-        auto count = read(&result[0], length);
+        wakeup_.notify_all();
 
-        if (count < 0)
-            return "";
+        for (auto& thread : threads_)
+            thread.join();
+    }
 
-        result.resize(count);
+    /**
+     * \copydoc executor::submit
+     */
+    void submit(std::function<void ()> task) override
+    {
+        auto self = current();
+        auto index = self.first == this ? self.second : next_++ % queues_.size();
 
-        return result;
+        {
+            auto& q = *queues_[index];
+            std::lock_guard<std::mutex> lock(q.mutex);
+
+            q.tasks.push_back(std::move(task));
+            ++ pending_;
+        }
+
+        // Taken so that a thread can't miss the wakeup between its check and its wait.
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        wakeup_.notify_one();
+    }
+
+    /**
+     * \copydoc executor::concurrency
+     */
+    unsigned concurrency() const noexcept override
+    {
+        return static_cast<unsigned>(threads_.size());
     }
 };
 
 /**
- * Add a file to the archive using a binary buffer.
+ * Get the executor used by the archives which have none set.
  *
- * \param data the buffer
- * \return the source to add
+ * \return the process wide thread pool, started on first use
+ * \see archive::set_executor
  */
-inline source source_buffer(std::string data) noexcept
+inline executor& default_executor()
 {
-    return [data = std::move(data)] (struct zip* archive) -> struct zip_source* {
-        auto size = data.size();
-        auto ptr = static_cast<char*>(std::malloc(size));
-
-        if (ptr == nullptr)
-            throw std::runtime_error(std::strerror(errno));
+    static thread_pool pool;
 
-        std::memcpy(ptr, data.data(), size);
-
-        auto src = zip_source_buffer(archive, ptr, size, 1);
-
-        if (src == nullptr) {
-            std::free(ptr);
-            throw std::runtime_error(zip_strerror(archive));
-        }
-
-        return src;
-    };
+    return pool;
 }
 
 /**
- * Add a file to the archive from the disk.
- *
- * \param path the path to the file
- * \param start the position where to start
- * \param length the number of bytes to copy
- * \return the source to add
+ * \brief Priority class of an I/O request.
  */
-inline source source_file(std::string path, uint64_t start = 0, int64_t length = -1) noexcept
-{
-    return [path = std::move(path), start, length] (struct zip* archive) -> struct zip_source* {
-        auto src = zip_source_file(archive, path.c_str(), start, length);
+enum class io_class {
+    interactive,                //!< latency sensitive, never delayed
+    background                  //!< bulk work, rate limited and yielding
+};
 
-        if (src == nullptr)
-            throw std::runtime_error(zip_strerror(archive));
+/**
+ * \brief Counters of one I/O class.
+ */
+struct io_counters {
+    uint64_t requests{0};                       //!< number of requests
+    uint64_t bytes{0};                          //!< bytes requested
+    uint64_t delayed{0};                        //!< requests which waited
+    std::chrono::nanoseconds wait{0};           //!< total queueing delay
+    std::chrono::nanoseconds max_wait{0};       //!< longest queueing delay
+};
 
-        return src;
-    };
-}
+/**
+ * \brief Snapshot of the counters of an io_scheduler.
+ */
+struct io_metrics {
+    io_counters interactive;    //!< interactive requests
+    io_counters background;     //!< background requests
+};
 
 /**
- * \brief Wrapper for stat as pointer.
+ * \brief Scheduler of the reads and writes made by the wrapper.
+ *
+ * Interactive requests (archive::open and file::read) are never delayed.
+ * Background requests (extract, search, peek, transform, merge, preload,
+ * prefetch...) first yield to the interactive requests in flight, for at
+ * most the defer delay so that they still progress under a steady
+ * interactive load, then take their bytes from a token bucket.
+ *
+ * One scheduler may be shared by several archives to limit them together.
+ *
+ * \see archive::set_io_scheduler
  */
-class stat_ptr {
+class io_scheduler {
 private:
-    stat stat_;
+    using clock = std::chrono::steady_clock;
+
+    mutable std::mutex mutex_;
+    std::condition_variable idle_;
+    uint64_t rate_;
+    uint64_t burst_;
+    double tokens_;
+    clock::time_point refill_{clock::now()};
+    std::chrono::nanoseconds defer_;
+    unsigned active_{0};
+    io_metrics metrics_;
+
+    io_scheduler(const io_scheduler&) = delete;
+    io_scheduler& operator=(const io_scheduler&) = delete;
+
+    static void account(io_counters& counters, uint64_t bytes, clock::duration wait) noexcept
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wait);
+
+        counters.requests += 1;
+        counters.bytes += bytes;
+        counters.wait += ns;
+        counters.max_wait = std::max(counters.max_wait, ns);
+
+        if (ns.count() > 0)
+            counters.delayed += 1;
+    }
 
 public:
     /**
      * Constructor.
      *
-     * \param stat the file stat
+     * \param rate the background bandwidth in bytes per second, 0 for no
+     * limit
+     * \param burst the bucket size in bytes, 0 for one second of rate
+     * \param defer the longest time a background request yields to
+     * interactive ones
      */
-    inline stat_ptr(stat stat) noexcept
-        : stat_(stat)
+    explicit io_scheduler(uint64_t rate = 0,
+                          uint64_t burst = 0,
+                          std::chrono::milliseconds defer = std::chrono::milliseconds(50)) noexcept
+        : rate_(rate)
+        , burst_(burst > 0 ? burst : rate)
+        , tokens_(static_cast<double>(burst_))
+        , defer_(defer)
     {
     }
 
     /**
-     * Get the reference.
+     * Change the background bandwidth.
      *
-     * \return the reference
+     * \param rate the bandwidth in bytes per second, 0 for no limit
+     * \param burst the bucket size in bytes, 0 for one second of rate
      */
-    inline stat& operator*() noexcept
+    void set_rate(uint64_t rate, uint64_t burst = 0)
     {
-        return stat_;
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        rate_ = rate;
+        burst_ = burst > 0 ? burst : rate;
+        tokens_ = std::min(tokens_, static_cast<double>(burst_));
+        idle_.notify_all();
     }
 
     /**
-     * Get the reference.
+     * Wait until a request may start.
      *
-     * \return the reference
+     * Every call must be matched by a release once the I/O is done.
+     * Requests larger than the bucket are let through and paid by the
+     * following ones.
+     *
+     * \param cls the class
+     * \param bytes the request size
      */
-    inline const stat& operator*() const noexcept
+    void acquire(io_class cls, uint64_t bytes)
     {
-        return stat_;
+        auto start = clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (cls == io_class::interactive) {
+            active_ += 1;
+            account(metrics_.interactive, bytes, clock::now() - start);
+            return;
+        }
+
+        idle_.wait_until(lock, start + defer_, [this] { return active_ == 0; });
+
+        for (;;) {
+            auto now = clock::now();
+
+            if (rate_ == 0)
+                break;
+
+            tokens_ = std::min(static_cast<double>(burst_),
+                tokens_ + std::chrono::duration<double>(now - refill_).count() * rate_);
+            refill_ = now;
+
+            if (tokens_ > 0) {
+                tokens_ -= bytes;
+                break;
+            }
+
+            idle_.wait_for(lock, std::chrono::duration<double>(-tokens_ / rate_));
+        }
+
+        account(metrics_.background, bytes, clock::now() - start);
     }
 
     /**
-     * Access the object.
+     * Mark the end of a request.
      *
-     * \return the pointer
+     * \param cls the class given to acquire
      */
-    inline stat* operator->() noexcept
+    void release(io_class cls) noexcept
     {
-        return &stat_;
+        if (cls != io_class::interactive)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (--active_ == 0)
+            idle_.notify_all();
     }
 
     /**
-     * Access the object.
+     * Get the counters.
      *
-     * \return the pointer
+     * \return the counters since construction
      */
-    inline const stat* operator->() const noexcept
+    io_metrics metrics() const
     {
-        return &stat_;
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return metrics_;
     }
 };
 
 /**
- * \brief Safe wrapper on the struct zip structure.
+ * \brief Internal helpers, not part of the public API.
  */
-class archive {
-private:
-    std::unique_ptr<struct zip, int (*)(struct zip *)> handle_;
+namespace detail {
 
-    archive(const archive&) = delete;
-    archive& operator=(const archive&) = delete;
+/**
+ * Open an archive, throwing the libzip error message on failure.
+ *
+ * \param path the path
+ * \param flags the open flags
+ * \return the handle, never null
+ * \throw std::runtime_error on errors
+ */
+inline struct zip* open(const std::string& path, int flags)
+{
+    int error;
+    struct zip* archive = zip_open(path.c_str(), flags, &error);
 
-public:
-    /**
-     * \brief Base iterator class
-     */
-    class iterator : public std::iterator<std::random_access_iterator_tag, libzip::stat> {
-    private:
-        friend class archive;
+    if (archive == nullptr) {
+        char buf[128]{0};
 
-        archive *archive_{nullptr};
-        uint64_t index_{0};
+        zip_error_to_str(buf, sizeof (buf), error, errno);
 
-        inline iterator(archive* archive, uint64_t index = 0) noexcept
-            : archive_(archive)
-            , index_(index)
-        {
-        }
+        throw std::runtime_error(buf);
+    }
 
-    public:
-        /**
-         * Default iterator.
-         */
-        iterator() noexcept = default;
+    return archive;
+}
 
-        /**
-         * Dereference the iterator.
-         *
-         * \return the stat information
-         */
-        inline libzip::stat operator*() const
-        {
-            assert(archive_);
+/**
+ * Compute the number of workers to use for count items.
+ *
+ * \param ex the executor
+ * \param concurrency the requested concurrency, 0 for the executor one
+ * \param count the number of items
+ * \return the number of workers, at least 1
+ */
+inline unsigned workers(const executor& ex, unsigned concurrency, std::size_t count) noexcept
+{
+    if (concurrency == 0)
+        concurrency = std::max(1U, ex.concurrency());
 
-            return archive_->stat(index_);
-        }
+    return static_cast<unsigned>(std::min<std::size_t>(concurrency, std::max<std::size_t>(count, 1)));
+}
 
-        /**
-         * Dereference the iterator.
-         *
-         * \return the stat information as point
-         */
+/**
+ * Call fn(slot, i) for every i in [0, count) on an executor.
+ *
+ * The slot is a stable worker number in [0, workers(ex, concurrency,
+ * count)) which lets the caller keep per-worker state (e.g. one libzip
+ * handle per thread). The calling thread takes part in the work. The first
+ * exception thrown by fn stops the remaining items and is rethrown.
+ *
+ * \param ex the executor
+ * \param count the number of items
+ * \param concurrency the maximum number of threads, 0 for the executor one
+ * \param fn the function
+ */
+template <typename Function>
+void parallel_for(executor& ex, std::size_t count, unsigned concurrency, Function&& fn)
+{
+    const auto n = workers(ex, concurrency, count);
+
+    if (n == 1) {
+        for (std::size_t i = 0; i < count; ++i)
+            fn(0U, i);
+    } else
+        ex.parallel_for(count, n, fn);
+}
+
+/**
+ * \brief Data source of a file which is not read through libzip.
+ */
+class stream {
+public:
+    /**
+     * Virtual destructor defaulted.
+     */
+    virtual ~stream() = default;
+
+    /**
+     * Read some data.
+     *
+     * \param data the destination buffer
+     * \param length the length
+     * \return the number of bytes written or -1 on failure
+     */
+    virtual int64_t read(void* data, uint64_t length) noexcept = 0;
+};
+
+/**
+ * \brief Stream over bytes already in memory.
+ */
+class memory_stream : public stream {
+private:
+    std::shared_ptr<const std::string> data_;
+    std::size_t offset_{0};
+
+public:
+    /**
+     * Constructor.
+     *
+     * \param data the content
+     */
+    inline memory_stream(std::shared_ptr<const std::string> data) noexcept
+        : data_(std::move(data))
+    {
+    }
+
+    /**
+     * \copydoc stream::read
+     */
+    int64_t read(void* data, uint64_t length) noexcept override
+    {
+        auto count = std::min<uint64_t>(length, data_->size() - offset_);
+
+        std::memcpy(data, data_->data() + offset_, count);
+        offset_ += count;
+
+        return count;
+    }
+};
+
+/**
+ * Match a name against a glob pattern.
+ *
+ * Supports '*' (any sequence, including '/') and '?' (any byte).
+ *
+ * \param pattern the pattern
+ * \param name the name
+ * \return true if it matches
+ */
+inline bool glob_match(const std::string& pattern, const std::string& name) noexcept
+{
+    std::size_t p = 0, n = 0, star = std::string::npos, mark = 0;
+
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            ++ p;
+            ++ n;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++ mark;
+        } else
+            return false;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*')
+        ++ p;
+
+    return p == pattern.size();
+}
+
+/**
+ * \brief Random access to the bytes of an archive.
+ *
+ * Reads are positional so one reader can be shared by several threads.
+ */
+class reader {
+public:
+    /**
+     * Virtual destructor defaulted.
+     */
+    virtual ~reader() = default;
+
+    /**
+     * Get the total size.
+     *
+     * \return the size in bytes
+     */
+    virtual uint64_t size() const noexcept = 0;
+
+    /**
+     * Read bytes at some offset, short reads only happen at the end.
+     *
+     * \param data the destination buffer
+     * \param length the number of bytes
+     * \param offset the position
+     * \return the number of bytes read
+     * \throw std::runtime_error on errors
+     */
+    virtual std::size_t read(void* data, std::size_t length, uint64_t offset) const = 0;
+
+    /**
+     * Hint that a range will be read soon.
+     *
+     * The default implementation reads the range so that it lands in the
+     * system cache.
+     *
+     * \param offset the position
+     * \param length the number of bytes
+     * \throw std::runtime_error on errors
+     */
+    virtual void prefetch(uint64_t offset, uint64_t length) const
+    {
+        std::vector<char> buffer(std::min<uint64_t>(length, 1U << 20));
+
+        while (length > 0) {
+            auto count = read(buffer.data(), std::min<uint64_t>(length, buffer.size()), offset);
+
+            if (count == 0)
+                break;
+
+            offset += count;
+            length -= count;
+        }
+    }
+};
+
+/**
+ * \brief Reader over a file on the disk.
+ */
+class file_reader : public reader {
+private:
+#if defined(_WIN32)
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp_;
+    mutable std::mutex mutex_;
+#else
+    int fd_;
+#endif
+    uint64_t size_{0};
+
+    file_reader(const file_reader&) = delete;
+    file_reader& operator=(const file_reader&) = delete;
+
+public:
+#if defined(_WIN32)
+    /**
+     * Open the file.
+     *
+     * \param path the path
+     * \throw std::runtime_error on errors
+     */
+    explicit file_reader(const std::string& path)
+        : fp_(std::fopen(path.c_str(), "rb"), std::fclose)
+    {
+        if (!fp_ || _fseeki64(fp_.get(), 0, SEEK_END) != 0)
+            throw std::runtime_error(std::strerror(errno));
+
+        size_ = _ftelli64(fp_.get());
+    }
+
+    /**
+     * \copydoc reader::read
+     */
+    std::size_t read(void* data, std::size_t length, uint64_t offset) const override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (_fseeki64(fp_.get(), offset, SEEK_SET) != 0)
+            throw std::runtime_error(std::strerror(errno));
+
+        auto count = std::fread(data, 1, length, fp_.get());
+
+        if (count < length && std::ferror(fp_.get()))
+            throw std::runtime_error(std::strerror(errno));
+
+        return count;
+    }
+#else
+    /**
+     * Open the file.
+     *
+     * \param path the path
+     * \throw std::runtime_error on errors
+     */
+    explicit file_reader(const std::string& path)
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+    {
+        struct ::stat st;
+
+        if (fd_ < 0)
+            throw std::runtime_error(std::strerror(errno));
+
+        if (::fstat(fd_, &st) < 0) {
+            auto error = errno;
+
+            ::close(fd_);
+            throw std::runtime_error(std::strerror(error));
+        }
+
+        size_ = st.st_size;
+    }
+
+    /**
+     * Close the file.
+     */
+    ~file_reader()
+    {
+        ::close(fd_);
+    }
+
+    /**
+     * Get the file descriptor.
+     *
+     * \return the descriptor
+     */
+    inline int fd() const noexcept
+    {
+        return fd_;
+    }
+
+    /**
+     * \copydoc reader::read
+     */
+    std::size_t read(void* data, std::size_t length, uint64_t offset) const override
+    {
+        std::size_t total = 0;
+
+        while (total < length) {
+            auto count = ::pread(fd_, static_cast<char*>(data) + total, length - total, offset + total);
+
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                throw std::runtime_error(std::strerror(errno));
+            if (count == 0)
+                break;
+
+            total += count;
+        }
+
+        return total;
+    }
+
+#if defined(POSIX_FADV_WILLNEED)
+    /**
+     * Ask the kernel to start reading the range in the background.
+     *
+     * \param offset the position
+     * \param length the number of bytes
+     */
+    void prefetch(uint64_t offset, uint64_t length) const override
+    {
+        ::posix_fadvise(fd_, offset, length, POSIX_FADV_WILLNEED);
+    }
+#endif
+#endif
+
+    /**
+     * \copydoc reader::size
+     */
+    uint64_t size() const noexcept override
+    {
+        return size_;
+    }
+};
+
+/**
+ * \brief Reader over volume files presented as one file.
+ *
+ * The volumes are the byte-wise split of one archive, the offsets of the
+ * archive are relative to the beginning of the first volume.
+ */
+class volume_reader : public reader {
+private:
+    std::vector<std::unique_ptr<file_reader>> volumes_;
+    std::vector<uint64_t> starts_;
+
+    template <typename Function>
+    void each(uint64_t offset, uint64_t length, Function&& fn) const
+    {
+        auto it = std::upper_bound(starts_.begin(), starts_.end(), offset);
+
+        for (auto i = std::distance(starts_.begin(), it) - 1; length > 0 && i < static_cast<long>(volumes_.size()); ++i) {
+            auto local = offset - starts_[i];
+            auto count = std::min(length, volumes_[i]->size() - local);
+
+            if (count > 0 && !fn(*volumes_[i], local, count))
+                break;
+
+            offset += count;
+            length -= count;
+        }
+    }
+
+public:
+    /**
+     * Open the volumes.
+     *
+     * \param paths the volume paths in order
+     * \throw std::runtime_error on errors
+     */
+    explicit volume_reader(const std::vector<std::string>& paths)
+    {
+        uint64_t start = 0;
+
+        for (const auto& path : paths) {
+            volumes_.emplace_back(new file_reader(path));
+            starts_.push_back(start);
+            start += volumes_.back()->size();
+        }
+
+        starts_.push_back(start);
+    }
+
+    /**
+     * \copydoc reader::size
+     */
+    uint64_t size() const noexcept override
+    {
+        return starts_.back();
+    }
+
+    /**
+     * \copydoc reader::read
+     */
+    std::size_t read(void* data, std::size_t length, uint64_t offset) const override
+    {
+        std::size_t total = 0;
+
+        each(offset, length, [&] (const file_reader& volume, uint64_t local, uint64_t count) {
+            auto n = volume.read(static_cast<char*>(data) + total, count, local);
+
+            total += n;
+
+            return n == count;
+        });
+
+        return total;
+    }
+
+    /**
+     * \copydoc reader::prefetch
+     */
+    void prefetch(uint64_t offset, uint64_t length) const override
+    {
+        each(offset, length, [] (const file_reader& volume, uint64_t local, uint64_t count) {
+            volume.prefetch(local, count);
+
+            return true;
+        });
+    }
+};
+
+/**
+ * \brief Reader over a range of another reader.
+ */
+class window_reader : public reader {
+private:
+    std::shared_ptr<const reader> parent_;
+    uint64_t offset_;
+    uint64_t length_;
+
+public:
+    /**
+     * Constructor.
+     *
+     * \param parent the underlying reader
+     * \param offset the beginning of the window
+     * \param length the size of the window
+     * \throw std::runtime_error if the window is out of the parent
+     */
+    window_reader(std::shared_ptr<const reader> parent, uint64_t offset, uint64_t length)
+        : parent_(std::move(parent))
+        , offset_(offset)
+        , length_(length)
+    {
+        if (offset > parent_->size() || length > parent_->size() - offset)
+            throw std::runtime_error("range out of file");
+    }
+
+    /**
+     * \copydoc reader::size
+     */
+    uint64_t size() const noexcept override
+    {
+        return length_;
+    }
+
+    /**
+     * \copydoc reader::read
+     */
+    std::size_t read(void* data, std::size_t length, uint64_t offset) const override
+    {
+        if (offset >= length_)
+            return 0;
+
+        return parent_->read(data, std::min<uint64_t>(length, length_ - offset), offset_ + offset);
+    }
+
+    /**
+     * \copydoc reader::prefetch
+     */
+    void prefetch(uint64_t offset, uint64_t length) const override
+    {
+        if (offset < length_)
+            parent_->prefetch(offset_ + offset, std::min(length, length_ - offset));
+    }
+};
+
+/**
+ * \brief Scope of a request scheduled by an io_scheduler.
+ */
+class io_guard {
+private:
+    io_scheduler* scheduler_;
+    io_class class_;
+
+    io_guard(const io_guard&) = delete;
+    io_guard& operator=(const io_guard&) = delete;
+
+public:
+    /**
+     * Wait until the request may start.
+     *
+     * \param scheduler the scheduler or null for none
+     * \param cls the class
+     * \param bytes the request size
+     */
+    io_guard(io_scheduler* scheduler, io_class cls, uint64_t bytes)
+        : scheduler_(scheduler)
+        , class_(cls)
+    {
+        if (scheduler_)
+            scheduler_->acquire(class_, bytes);
+    }
+
+    /**
+     * Release the request.
+     */
+    ~io_guard()
+    {
+        if (scheduler_)
+            scheduler_->release(class_);
+    }
+};
+
+/**
+ * \brief Reader whose reads are scheduled in some I/O class.
+ */
+class scheduled_reader : public reader {
+private:
+    std::shared_ptr<const reader> parent_;
+    std::shared_ptr<io_scheduler> scheduler_;
+    io_class class_;
+
+public:
+    /**
+     * Constructor.
+     *
+     * \param parent the underlying reader
+     * \param scheduler the scheduler
+     * \param cls the class of the reads
+     */
+    scheduled_reader(std::shared_ptr<const reader> parent, std::shared_ptr<io_scheduler> scheduler, io_class cls) noexcept
+        : parent_(std::move(parent))
+        , scheduler_(std::move(scheduler))
+        , class_(cls)
+    {
+    }
+
+    /**
+     * \copydoc reader::size
+     */
+    uint64_t size() const noexcept override
+    {
+        return parent_->size();
+    }
+
+    /**
+     * \copydoc reader::read
+     */
+    std::size_t read(void* data, std::size_t length, uint64_t offset) const override
+    {
+        io_guard guard(scheduler_.get(), class_, length);
+
+        return parent_->read(data, length, offset);
+    }
+
+    /**
+     * \copydoc reader::prefetch
+     */
+    void prefetch(uint64_t offset, uint64_t length) const override
+    {
+        io_guard guard(scheduler_.get(), class_, length);
+
+        parent_->prefetch(offset, length);
+    }
+};
+
+/**
+ * \brief Anonymous temporary file holding data until an archive is
+ * written.
+ *
+ * Data is appended by any thread and read back by ranges, the file is
+ * removed by the system once closed.
+ */
+class spill_file : public reader {
+private:
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp_;
+    mutable std::mutex mutex_;
+    std::atomic<uint64_t> size_{0};
+
+    void seek(uint64_t offset) const
+    {
+#if defined(_WIN32)
+        auto ret = _fseeki64(fp_.get(), offset, SEEK_SET);
+#else
+        auto ret = ::fseeko(fp_.get(), offset, SEEK_SET);
+#endif
+
+        if (ret != 0)
+            throw std::runtime_error(std::strerror(errno));
+    }
+
+public:
+    /**
+     * Create the file.
+     *
+     * \throw std::runtime_error on errors
+     */
+    spill_file()
+        : fp_(std::tmpfile(), std::fclose)
+    {
+        if (!fp_)
+            throw std::runtime_error(std::strerror(errno));
+    }
+
+    /**
+     * Append data.
+     *
+     * \param data the data
+     * \return the offset of the data
+     * \throw std::runtime_error on errors
+     */
+    uint64_t append(const std::string& data)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t offset = size_;
+
+        seek(offset);
+
+        if (!data.empty() && std::fwrite(data.data(), data.size(), 1, fp_.get()) != 1)
+            throw std::runtime_error(std::strerror(errno));
+
+        size_ += data.size();
+
+        return offset;
+    }
+
+    /**
+     * \copydoc reader::size
+     */
+    uint64_t size() const noexcept override
+    {
+        return size_;
+    }
+
+    /**
+     * \copydoc reader::read
+     */
+    std::size_t read(void* data, std::size_t length, uint64_t offset) const override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        seek(offset);
+
+        auto count = std::fread(data, 1, length, fp_.get());
+
+        if (count < length && std::ferror(fp_.get()))
+            throw std::runtime_error(std::strerror(errno));
+
+        return count;
+    }
+};
+
+/**
+ * \brief State of a libzip source function over a reader.
+ *
+ * With a raw stat, the bytes are already compressed and the stat gives
+ * libzip their method, sizes and CRC so it writes them as they are.
+ */
+struct reader_source {
+    std::shared_ptr<const reader> source;
+    uint64_t offset{0};
+    bool raw{false};
+    zip_stat_t raw_stat;
+    zip_error_t error;
+
+    static zip_int64_t callback(void* state, void* data, zip_uint64_t length, zip_source_cmd_t cmd)
+    {
+        auto self = static_cast<reader_source*>(state);
+
+        switch (cmd) {
+        case ZIP_SOURCE_OPEN:
+            self->offset = 0;
+            return 0;
+        case ZIP_SOURCE_READ:
+            try {
+                auto count = self->source->read(data, length, self->offset);
+
+                self->offset += count;
+
+                return count;
+            } catch (const std::exception&) {
+                zip_error_set(&self->error, ZIP_ER_READ, errno);
+                return -1;
+            }
+        case ZIP_SOURCE_CLOSE:
+            return 0;
+        case ZIP_SOURCE_STAT: {
+            auto st = ZIP_SOURCE_GET_ARGS(zip_stat_t, data, length, &self->error);
+
+            if (st == nullptr)
+                return -1;
+            if (self->raw) {
+                *st = self->raw_stat;
+                return sizeof (zip_stat_t);
+            }
+
+            zip_stat_init(st);
+            st->size = self->source->size();
+            st->valid |= ZIP_STAT_SIZE;
+
+            return sizeof (zip_stat_t);
+        }
+        case ZIP_SOURCE_ERROR:
+            return zip_error_to_data(&self->error, data, length);
+        case ZIP_SOURCE_FREE:
+            zip_error_fini(&self->error);
+            delete self;
+            return 0;
+        case ZIP_SOURCE_SEEK: {
+            auto args = ZIP_SOURCE_GET_ARGS(zip_source_args_seek, data, length, &self->error);
+
+            if (args == nullptr)
+                return -1;
+
+            int64_t base = args->whence == SEEK_CUR ? self->offset :
+                           args->whence == SEEK_END ? self->source->size() : 0;
+
+            if (base + args->offset < 0 || static_cast<uint64_t>(base + args->offset) > self->source->size()) {
+                zip_error_set(&self->error, ZIP_ER_INVAL, 0);
+                return -1;
+            }
+
+            self->offset = base + args->offset;
+
+            return 0;
+        }
+        case ZIP_SOURCE_TELL:
+            return self->offset;
+        case ZIP_SOURCE_SUPPORTS:
+            return ZIP_SOURCE_SUPPORTS_SEEKABLE;
+        default:
+            zip_error_set(&self->error, ZIP_ER_OPNOTSUPP, 0);
+            return -1;
+        }
+    }
+};
+
+/**
+ * Open an archive through a reader.
+ *
+ * \param source the reader, shared with the returned handle
+ * \param flags the flags, ZIP_RDONLY is implied
+ * \return the handle
+ * \throw std::runtime_error on errors
+ */
+inline struct zip* open(std::shared_ptr<const reader> source, int flags)
+{
+    zip_error_t error;
+    std::unique_ptr<reader_source> state(new reader_source);
+
+    state->source = std::move(source);
+    zip_error_init(&state->error);
+    zip_error_init(&error);
+
+    auto src = zip_source_function_create(reader_source::callback, state.get(), &error);
+
+    if (src == nullptr) {
+        std::string message = zip_error_strerror(&error);
+
+        zip_error_fini(&error);
+        zip_error_fini(&state->error);
+        throw std::runtime_error(message);
+    }
+
+    // Owned by the source from now on, freed with ZIP_SOURCE_FREE.
+    state.release();
+
+    auto archive = zip_open_from_source(src, flags | ZIP_RDONLY, &error);
+
+    if (archive == nullptr) {
+        std::string message = zip_error_strerror(&error);
+
+        zip_source_free(src);
+        zip_error_fini(&error);
+        throw std::runtime_error(message);
+    }
+
+    zip_error_fini(&error);
+
+    return archive;
+}
+
+/**
+ * Create a seekable source over a reader.
+ *
+ * \param archive the archive
+ * \param source the reader, shared with the returned source
+ * \param raw the stat of already compressed bytes or null
+ * \return the source
+ * \throw std::runtime_error on errors
+ */
+inline struct zip_source* make_source(struct zip* archive, std::shared_ptr<const reader> source, const zip_stat_t* raw = nullptr)
+{
+    std::unique_ptr<reader_source> state(new reader_source);
+
+    state->source = std::move(source);
+    state->raw = raw != nullptr;
+
+    if (raw)
+        state->raw_stat = *raw;
+
+    zip_error_init(&state->error);
+
+    auto src = zip_source_function(archive, reader_source::callback, state.get());
+
+    if (src == nullptr) {
+        zip_error_fini(&state->error);
+        throw std::runtime_error(zip_strerror(archive));
+    }
+
+    // Owned by the source from now on, freed with ZIP_SOURCE_FREE.
+    state.release();
+
+    return src;
+}
+
+/**
+ * Open an archive on the disk or through a reader.
+ *
+ * \param path the archive path, used if view is null
+ * \param view the archive bytes (volumes, window) or null
+ * \param flags the flags
+ * \return the handle
+ * \throw std::runtime_error on errors
+ */
+inline struct zip* open(const std::string& path, const std::shared_ptr<const reader>& view, int flags)
+{
+    return view ? open(view, flags) : open(path, flags);
+}
+
+/**
+ * Decode a little endian 16 bits integer.
+ *
+ * \param p the bytes
+ * \return the value
+ */
+inline uint16_t le16(const uint8_t* p) noexcept
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+/**
+ * Decode a little endian 32 bits integer.
+ *
+ * \param p the bytes
+ * \return the value
+ */
+inline uint32_t le32(const uint8_t* p) noexcept
+{
+    return le16(p) | (static_cast<uint32_t>(le16(p + 2)) << 16);
+}
+
+/**
+ * Decode a little endian 64 bits integer.
+ *
+ * \param p the bytes
+ * \return the value
+ */
+inline uint64_t le64(const uint8_t* p) noexcept
+{
+    return le32(p) | (static_cast<uint64_t>(le32(p + 4)) << 32);
+}
+
+/**
+ * \brief Central directory record, as stored on disk.
+ */
+struct cd_entry {
+    uint64_t record;        //!< position of the record in central_directory::data()
+    uint64_t offset;        //!< local header position, relative to the archive start
+    uint64_t comp_size;     //!< compressed size
+    uint64_t size;          //!< uncompressed size
+    uint32_t crc;           //!< CRC-32 of the uncompressed data
+    uint16_t method;        //!< compression method
+    uint16_t flags;         //!< general purpose flags
+    uint16_t dos_time;      //!< MS-DOS modification time
+    uint16_t dos_date;      //!< MS-DOS modification date
+    uint16_t name_size;     //!< name length, the name follows the record
+    uint16_t extra_size;    //!< extra fields length, they follow the name
+};
+
+/**
+ * Id of the central extra field marking an archive whose central directory
+ * is sorted by name, see archive::enable_sorted_directory.
+ *
+ * It's set on the first record and holds a version (1 byte, 1), the number
+ * of entries (8 bytes) and the CRC-32 of the names each followed by a NUL
+ * (4 bytes), little endian. A directory changed by another writer no longer
+ * matches the count or the CRC and is treated as unsorted.
+ */
+constexpr uint16_t sorted_field = 0x5a53;
+
+/**
+ * Compare two raw names bytewise, a prefix comes first.
+ *
+ * \param lhs the first name
+ * \param lsize the first name length
+ * \param rhs the second name
+ * \param rsize the second name length
+ * \return <0, 0 or >0 like memcmp
+ */
+inline int compare_names(const char* lhs, std::size_t lsize, const char* rhs, std::size_t rsize) noexcept
+{
+    auto cmp = std::memcmp(lhs, rhs, std::min(lsize, rsize));
+
+    if (cmp != 0)
+        return cmp;
+
+    return lsize < rsize ? -1 : lsize > rsize;
+}
+
+/**
+ * \brief Central directory read directly from an archive.
+ *
+ * libzip does not give the position of the entries data, this small parser
+ * reads the end of central directory (including ZIP64) and keeps the raw
+ * records in memory so that names and extra fields can be accessed without
+ * copies. Entries are in the same order as the libzip indices of an
+ * unmodified archive.
+ */
+class central_directory {
+private:
+    std::vector<uint8_t> data_;
+    std::vector<cd_entry> entries_;
+    uint64_t base_{0};
+    uint64_t end_{0};
+    uint64_t offset_{0};
+    bool sorted_{false};
+
+    static constexpr uint32_t eocd_sig = 0x06054b50;
+    static constexpr uint32_t eocd64_sig = 0x06064b50;
+    static constexpr uint32_t locator_sig = 0x07064b50;
+    static constexpr uint32_t record_sig = 0x02014b50;
+    static constexpr uint32_t local_sig = 0x04034b50;
+
+    static std::vector<uint8_t> load(const reader& reader, uint64_t offset, uint64_t length)
+    {
+        if (offset > reader.size() || length > reader.size() - offset)
+            throw std::runtime_error("truncated zip archive");
+
+        std::vector<uint8_t> data(length);
+
+        if (reader.read(data.data(), length, offset) != length)
+            throw std::runtime_error("truncated zip archive");
+
+        return data;
+    }
+
+    void parse(uint64_t count)
+    {
+        std::size_t pos = 0;
+
+        entries_.reserve(count);
+
+        for (uint64_t i = 0; i < count; ++i) {
+            if (data_.size() - pos < 46 || le32(&data_[pos]) != record_sig)
+                throw std::runtime_error("invalid central directory");
+
+            const auto p = &data_[pos];
+            cd_entry entry;
+
+            entry.record = pos;
+            entry.flags = le16(p + 8);
+            entry.method = le16(p + 10);
+            entry.dos_time = le16(p + 12);
+            entry.dos_date = le16(p + 14);
+            entry.crc = le32(p + 16);
+            entry.comp_size = le32(p + 20);
+            entry.size = le32(p + 24);
+            entry.name_size = le16(p + 28);
+            entry.extra_size = le16(p + 30);
+            entry.offset = le32(p + 42);
+
+            const std::size_t length = 46U + entry.name_size + entry.extra_size + le16(p + 32);
+
+            if (data_.size() - pos < length)
+                throw std::runtime_error("invalid central directory");
+
+            // ZIP64 extended information, only the saturated fields are present.
+            auto extra = p + 46 + entry.name_size;
+
+            for (std::size_t x = 0; x + 4 <= entry.extra_size; ) {
+                auto id = le16(extra + x);
+                auto size = le16(extra + x + 2);
+                auto field = extra + x + 4;
+                auto end = std::min<std::size_t>(x + 4 + size, entry.extra_size);
+
+                if (id == 0x0001) {
+                    auto at = static_cast<std::size_t>(field - extra);
+
+                    if (entry.size == 0xffffffff && at + 8 <= end) {
+                        entry.size = le64(extra + at);
+                        at += 8;
+                    }
+                    if (entry.comp_size == 0xffffffff && at + 8 <= end) {
+                        entry.comp_size = le64(extra + at);
+                        at += 8;
+                    }
+                    if (entry.offset == 0xffffffff && at + 8 <= end)
+                        entry.offset = le64(extra + at);
+                }
+
+                x += 4 + size;
+            }
+
+            entries_.push_back(entry);
+            pos += length;
+        }
+
+        if (entries_.empty())
+            return;
+
+        // Trust the sorted marker only if the names are those it was made for.
+        const Bytef nul = 0;
+        uLong crc = ::crc32(0, nullptr, 0);
+
+        for (const auto& entry : entries_) {
+            crc = ::crc32(crc, &data_[entry.record + 46], entry.name_size);
+            crc = ::crc32(crc, &nul, 1);
+        }
+
+        for_each_extra(entries_[0], [&] (uint16_t id, const uint8_t* data, uint16_t size) {
+            if (id == sorted_field && size == 13 && data[0] == 1 && le64(data + 1) == entries_.size() && le32(data + 9) == crc)
+                sorted_ = true;
+        });
+    }
+
+public:
+    /**
+     * Read the central directory.
+     *
+     * \param reader the archive bytes
+     * \throw std::runtime_error on errors
+     */
+    explicit central_directory(const reader& reader)
+    {
+        const auto size = reader.size();
+        const auto tail_size = std::min<uint64_t>(size, 22 + 65535);
+        const auto tail_start = size - tail_size;
+        const auto tail = load(reader, tail_start, tail_size);
+
+        // Search the end of central directory backwards, skipping the comment.
+        std::size_t eocd = tail.size();
+
+        for (std::size_t i = tail.size() >= 22 ? tail.size() - 22 + 1 : 0; i-- > 0; ) {
+            if (le32(&tail[i]) == eocd_sig && i + 22 + le16(&tail[i + 20]) <= tail.size()) {
+                eocd = i;
+                break;
+            }
+        }
+
+        if (eocd == tail.size())
+            throw std::runtime_error("not a zip archive");
+
+        const auto eocd_pos = tail_start + eocd;
+
+        end_ = eocd_pos + 22 + le16(&tail[eocd + 20]);
+
+        uint64_t count = le16(&tail[eocd + 10]);
+        uint64_t cd_size = le32(&tail[eocd + 12]);
+        uint64_t cd_offset = le32(&tail[eocd + 16]);
+        uint64_t end = eocd_pos;
+
+        if ((count == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff) && eocd_pos >= 20) {
+            auto locator = load(reader, eocd_pos - 20, 20);
+
+            if (le32(&locator[0]) == locator_sig) {
+                auto relative = le64(&locator[8]);
+
+                if (eocd_pos < 20 + 56 || relative > eocd_pos - 20 - 56)
+                    throw std::runtime_error("invalid zip64 end of central directory");
+
+                // The record normally precedes the locator directly.
+                end = eocd_pos - 20 - 56;
+                base_ = end - relative;
+
+                auto eocd64 = load(reader, end, 56);
+
+                if (le32(&eocd64[0]) != eocd64_sig)
+                    throw std::runtime_error("invalid zip64 end of central directory");
+
+                count = le64(&eocd64[32]);
+                cd_size = le64(&eocd64[40]);
+                cd_offset = le64(&eocd64[48]);
+            }
+        }
+
+        if (end < cd_size || end - cd_size < cd_offset)
+            throw std::runtime_error("invalid central directory position");
+        if (end == eocd_pos)
+            base_ = end - cd_size - cd_offset;
+
+        offset_ = base_ + cd_offset;
+        data_ = load(reader, offset_, cd_size);
+        parse(count);
+    }
+
+    /**
+     * Get the entries.
+     *
+     * \return the entries
+     */
+    inline const std::vector<cd_entry>& entries() const noexcept
+    {
+        return entries_;
+    }
+
+    /**
+     * Get the raw records.
+     *
+     * \return the bytes
+     */
+    inline const uint8_t* data() const noexcept
+    {
+        return data_.data();
+    }
+
+    /**
+     * Get the position of the archive in the file, non zero when data was
+     * prepended to it (e.g. a self extracting executable).
+     *
+     * \return the position
+     */
+    inline uint64_t base() const noexcept
+    {
+        return base_;
+    }
+
+    /**
+     * Get the position of the central directory in the file.
+     *
+     * \return the position
+     */
+    inline uint64_t offset() const noexcept
+    {
+        return offset_;
+    }
+
+    /**
+     * Tell if the records are sorted by name, as marked by the writer.
+     *
+     * \return true if sorted
+     * \see sorted_field
+     */
+    inline bool sorted() const noexcept
+    {
+        return sorted_;
+    }
+
+    /**
+     * Get the size of the record of an entry, with its name, extra fields
+     * and comment.
+     *
+     * \param entry the entry
+     * \return the size in bytes
+     */
+    inline std::size_t record_size(const cd_entry& entry) const noexcept
+    {
+        return 46U + entry.name_size + entry.extra_size + le16(&data_[entry.record + 32]);
+    }
+
+    /**
+     * Locate an entry by name with a binary search over the records.
+     *
+     * \pre sorted()
+     * \param name the raw name
+     * \param length the name length
+     * \return the first index with that name or -1 if not found
+     */
+    int64_t find(const char* name, std::size_t length) const noexcept
+    {
+        assert(sorted_);
+
+        auto it = std::lower_bound(entries_.begin(), entries_.end(), 0, [&] (const cd_entry& entry, int) {
+            return compare_names(this->name(entry), entry.name_size, name, length) < 0;
+        });
+
+        if (it == entries_.end() || compare_names(this->name(*it), it->name_size, name, length) != 0)
+            return -1;
+
+        return it - entries_.begin();
+    }
+
+    /**
+     * Get the position just after the archive, including its comment.
+     *
+     * \return the position
+     */
+    inline uint64_t end() const noexcept
+    {
+        return end_;
+    }
+
+    /**
+     * Get the raw name of an entry.
+     *
+     * \param entry the entry
+     * \return the name, not terminated
+     */
+    inline const char* name(const cd_entry& entry) const noexcept
+    {
+        return reinterpret_cast<const char*>(&data_[entry.record + 46]);
+    }
+
+    /**
+     * Get the central extra fields of an entry.
+     *
+     * \param entry the entry
+     * \return the fields, entry.extra_size bytes
+     */
+    inline const uint8_t* extra(const cd_entry& entry) const noexcept
+    {
+        return &data_[entry.record + 46 + entry.name_size];
+    }
+
+    /**
+     * Call fn(id, data, size) for each central extra field of an entry.
+     *
+     * \param entry the entry
+     * \param fn the function
+     */
+    template <typename Function>
+    void for_each_extra(const cd_entry& entry, Function&& fn) const
+    {
+        auto extra = this->extra(entry);
+
+        for (std::size_t x = 0; x + 4 <= entry.extra_size; ) {
+            auto size = std::min<std::size_t>(le16(extra + x + 2), entry.extra_size - x - 4);
+
+            fn(le16(extra + x), extra + x + 4, static_cast<uint16_t>(size));
+            x += 4 + size;
+        }
+    }
+
+    /**
+     * Get the position of the entry data in the file, reading its local
+     * header.
+     *
+     * \param reader the archive bytes
+     * \param entry the entry
+     * \return the position
+     * \throw std::runtime_error on errors
+     */
+    uint64_t data_offset(const reader& reader, const cd_entry& entry) const
+    {
+        auto local = load(reader, base_ + entry.offset, 30);
+
+        if (le32(&local[0]) != local_sig)
+            throw std::runtime_error("invalid local header");
+
+        return base_ + entry.offset + 30 + le16(&local[26]) + le16(&local[28]);
+    }
+};
+
+/**
+ * Check that some bytes are valid UTF-8.
+ *
+ * ASCII is skipped 8 bytes at a time, other sequences are checked for
+ * overlong forms, surrogates and code points above U+10FFFF.
+ *
+ * \param data the bytes
+ * \param length the number of bytes
+ * \return true if valid
+ */
+inline bool valid_utf8(const char* data, std::size_t length) noexcept
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    auto end = p + length;
+
+    while (p < end) {
+        if (end - p >= 8) {
+            std::uint64_t word;
+
+            std::memcpy(&word, p, 8);
+
+            if ((word & 0x8080808080808080ULL) == 0) {
+                p += 8;
+                continue;
+            }
+        }
+
+        if (*p < 0x80) {
+            ++ p;
+            continue;
+        }
+
+        std::size_t size;
+        unsigned char min = 0x80, max = 0xbf;
+
+        if (*p >= 0xc2 && *p <= 0xdf)
+            size = 2;
+        else if (*p >= 0xe0 && *p <= 0xef) {
+            size = 3;
+            min = *p == 0xe0 ? 0xa0 : 0x80;
+            max = *p == 0xed ? 0x9f : 0xbf;
+        } else if (*p >= 0xf0 && *p <= 0xf4) {
+            size = 4;
+            min = *p == 0xf0 ? 0x90 : 0x80;
+            max = *p == 0xf4 ? 0x8f : 0xbf;
+        } else
+            return false;
+
+        if (static_cast<std::size_t>(end - p) < size || p[1] < min || p[1] > max)
+            return false;
+
+        for (std::size_t i = 2; i < size; ++i)
+            if ((p[i] & 0xc0) != 0x80)
+                return false;
+
+        p += size;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Read-only libzip handle, discarded on destruction.
+ */
+using readonly_handle = std::unique_ptr<struct zip, void (*)(struct zip*)>;
+
+/**
+ * \brief One read-only handle per worker.
+ *
+ * A struct zip can't be used by several threads at once, parallel
+ * operations therefore open the archive again for each worker. Handles are
+ * opened lazily on first use of a slot.
+ */
+class handle_pool {
+private:
+    std::string path_;
+    std::shared_ptr<const reader> view_;
+    std::vector<readonly_handle> handles_;
+
+public:
+    /**
+     * Constructor.
+     *
+     * \param path the archive path
+     * \param workers the number of slots
+     * \param view the archive bytes to open instead of path or null
+     */
+    inline handle_pool(std::string path, unsigned workers, std::shared_ptr<const reader> view = nullptr)
+        : path_(std::move(path))
+        , view_(std::move(view))
+    {
+        for (unsigned i = 0; i < workers; ++i)
+            handles_.emplace_back(nullptr, zip_discard);
+    }
+
+    /**
+     * Get the handle for a worker slot.
+     *
+     * \param slot the slot as given by parallel_for
+     * \return the handle
+     * \throw std::runtime_error on errors
+     */
+    inline struct zip* get(unsigned slot)
+    {
+        assert(slot < handles_.size());
+
+        if (!handles_[slot])
+            handles_[slot].reset(open(path_, view_, ZIP_RDONLY));
+
+        return handles_[slot].get();
+    }
+};
+
+/**
+ * Find all occurrences of needle in an entry, streaming its content.
+ *
+ * The content is read in fixed size chunks and the last needle.size() - 1
+ * bytes are carried to the next chunk so that matches across chunks are
+ * found. Candidates are located with memchr which is vectorized by most C
+ * libraries.
+ *
+ * \pre !needle.empty()
+ * \param handle the archive
+ * \param index the entry index
+ * \param needle the bytes to look for
+ * \param first_only stop at the first match
+ * \return the offsets of the matches in the uncompressed content
+ * \throw std::runtime_error on errors
+ */
+inline std::vector<uint64_t> find_all(struct zip* handle, uint64_t index, const std::string& needle, bool first_only)
+{
+    assert(!needle.empty());
+
+    constexpr std::size_t chunk = 65536;
+
+    std::unique_ptr<struct zip_file, int (*)(struct zip_file*)> file(zip_fopen_index(handle, index, 0), zip_fclose);
+
+    if (!file)
+        throw std::runtime_error(zip_strerror(handle));
+
+    std::vector<uint64_t> offsets;
+    std::vector<char> buffer(needle.size() - 1 + chunk);
+    std::size_t kept = 0;
+    uint64_t base = 0;
+
+    for (;;) {
+        auto count = zip_fread(file.get(), buffer.data() + kept, chunk);
+
+        if (count < 0)
+            throw std::runtime_error(zip_strerror(handle));
+        if (count == 0)
+            break;
+
+        auto end = kept + static_cast<std::size_t>(count);
+        auto first = buffer.data();
+        auto last = buffer.data() + end;
+
+        while (static_cast<std::size_t>(last - first) >= needle.size()) {
+            first = static_cast<char*>(std::memchr(first, needle[0], last - first - needle.size() + 1));
+
+            if (first == nullptr)
+                break;
+            if (std::memcmp(first, needle.data(), needle.size()) == 0) {
+                offsets.push_back(base + (first - buffer.data()));
+
+                if (first_only)
+                    return offsets;
+            }
+
+            ++ first;
+        }
+
+        kept = std::min(end, needle.size() - 1);
+        std::memmove(buffer.data(), buffer.data() + end - kept, kept);
+        base += end - kept;
+    }
+
+    return offsets;
+}
+
+/**
+ * Read at most length bytes from the beginning of an entry.
+ *
+ * The buffer is sized to the smallest of length and the entry size, not to
+ * the whole entry.
+ *
+ * \param handle the archive
+ * \param index the entry index
+ * \param length the maximum number of bytes
+ * \return the bytes
+ * \throw std::runtime_error on errors
+ */
+inline std::string head(struct zip* handle, uint64_t index, uint64_t length)
+{
+    struct zip_stat st;
+
+    if (zip_stat_index(handle, index, 0, &st) < 0)
+        throw std::runtime_error(zip_strerror(handle));
+    if (st.valid & ZIP_STAT_SIZE)
+        length = std::min(length, st.size);
+
+    std::unique_ptr<struct zip_file, int (*)(struct zip_file*)> file(zip_fopen_index(handle, index, 0), zip_fclose);
+
+    if (!file)
+        throw std::runtime_error(zip_strerror(handle));
+
+    std::string result(length, '\0');
+    uint64_t total = 0;
+
+    while (total < length) {
+        auto count = zip_fread(file.get(), &result[total], length - total);
+
+        if (count < 0)
+            throw std::runtime_error(zip_strerror(handle));
+        if (count == 0)
+            break;
+
+        total += count;
+    }
+
+    result.resize(total);
+
+    return result;
+}
+
+#if !defined(_WIN32)
+
+/**
+ * \brief Source function reading a file range through memory mappings.
+ *
+ * The range is mapped one window at a time with a sequential access hint
+ * and every window is unmapped once read past, so a huge input never takes
+ * more than one window of address space.
+ */
+struct mmap_source {
+    static constexpr uint64_t window = 64 << 20;
+
+    std::string path;
+    uint64_t start{0};
+    uint64_t size{0};
+    time_t mtime{0};
+    int fd{-1};
+    uint64_t offset{0};
+    char* map{nullptr};
+    uint64_t map_offset{0};
+    std::size_t map_length{0};
+    zip_error_t error;
+
+    void unmap() noexcept
+    {
+        if (map != nullptr)
+            ::munmap(map, map_length);
+
+        map = nullptr;
+    }
+
+    // Map the window holding the file position pos.
+    bool remap(uint64_t pos) noexcept
+    {
+        unmap();
+
+        map_offset = pos - pos % window;
+        map_length = std::min(start + size - map_offset, static_cast<uint64_t>(window));
+
+        auto ptr = ::mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE, fd, map_offset);
+
+        if (ptr == MAP_FAILED)
+            return false;
+
+        map = static_cast<char*>(ptr);
+        ::madvise(map, map_length, MADV_SEQUENTIAL);
+
+        return true;
+    }
+
+    static zip_int64_t callback(void* state, void* data, zip_uint64_t length, zip_source_cmd_t cmd)
+    {
+        auto self = static_cast<mmap_source*>(state);
+
+        switch (cmd) {
+        case ZIP_SOURCE_OPEN:
+            if ((self->fd = ::open(self->path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+                zip_error_set(&self->error, ZIP_ER_OPEN, errno);
+                return -1;
+            }
+
+            self->offset = 0;
+
+            return 0;
+        case ZIP_SOURCE_READ: {
+            if (self->offset >= self->size)
+                return 0;
+
+            auto pos = self->start + self->offset;
+
+            if ((self->map == nullptr || pos < self->map_offset || pos >= self->map_offset + self->map_length) &&
+                !self->remap(pos)) {
+                zip_error_set(&self->error, ZIP_ER_READ, errno);
+                return -1;
+            }
+
+            auto count = std::min<uint64_t>({length, self->size - self->offset, self->map_offset + self->map_length - pos});
+
+            std::memcpy(data, self->map + (pos - self->map_offset), count);
+            self->offset += count;
+
+            return count;
+        }
+        case ZIP_SOURCE_CLOSE:
+            self->unmap();
+            ::close(self->fd);
+            self->fd = -1;
+            return 0;
+        case ZIP_SOURCE_STAT: {
+            auto st = ZIP_SOURCE_GET_ARGS(zip_stat_t, data, length, &self->error);
+
+            if (st == nullptr)
+                return -1;
+
+            zip_stat_init(st);
+            st->size = self->size;
+            st->mtime = self->mtime;
+            st->valid |= ZIP_STAT_SIZE | ZIP_STAT_MTIME;
+
+            return sizeof (zip_stat_t);
+        }
+        case ZIP_SOURCE_ERROR:
+            return zip_error_to_data(&self->error, data, length);
+        case ZIP_SOURCE_FREE:
+            self->unmap();
+
+            if (self->fd >= 0)
+                ::close(self->fd);
+
+            zip_error_fini(&self->error);
+            delete self;
+            return 0;
+        case ZIP_SOURCE_SEEK: {
+            auto args = ZIP_SOURCE_GET_ARGS(zip_source_args_seek, data, length, &self->error);
+
+            if (args == nullptr)
+                return -1;
+
+            int64_t base = args->whence == SEEK_CUR ? self->offset :
+                           args->whence == SEEK_END ? self->size : 0;
+
+            if (base + args->offset < 0 || static_cast<uint64_t>(base + args->offset) > self->size) {
+                zip_error_set(&self->error, ZIP_ER_INVAL, 0);
+                return -1;
+            }
+
+            self->offset = base + args->offset;
+
+            return 0;
+        }
+        case ZIP_SOURCE_TELL:
+            return self->offset;
+        case ZIP_SOURCE_SUPPORTS:
+            return ZIP_SOURCE_SUPPORTS_SEEKABLE;
+        default:
+            zip_error_set(&self->error, ZIP_ER_OPNOTSUPP, 0);
+            return -1;
+        }
+    }
+};
+
+#endif
+
+} // !detail
+
+/**
+ * \brief Source creation for adding files.
+ *
+ * This function must be passed through archive::add, it will be called to
+ * create the appropriate zip_source  * inside the function.
+ *
+ * The user should not call the function itself as it's the responsability of
+ * libzip to destroy the zip_source structure.
+ *
+ * \see source::buffer
+ * \see source::file
+ */
+using source = std::function<struct zip_source* (struct zip*)>;
+
+/**
+ * \brief File for reading.
+ */
+class file {
+private:
+    std::unique_ptr<struct zip_file, int (*)(struct zip_file*)> handle_;
+    std::unique_ptr<detail::stream> stream_;
+    std::shared_ptr<io_scheduler> io_;
+
+    file(const file&) = delete;
+    file& operator=(const file&) = delete;
+
+public:
+    /**
+     * Create a File with a zip_file structure.
+     *
+     * \param file the file ready to be used
+     */
+    inline file(struct zip_file* file) noexcept
+        : handle_(file, zip_fclose)
+    {
+    }
+
+    /**
+     * Create a File reading from another stream.
+     *
+     * \param stream the stream
+     */
+    inline file(std::unique_ptr<detail::stream> stream) noexcept
+        : handle_(nullptr, zip_fclose)
+        , stream_(std::move(stream))
+    {
+    }
+
+    /**
+     * Move constructor defaulted.
+     *
+     * \param other the other File
+     */
+    file(file&& other) noexcept = default;
+
+    /**
+     * Move operator defaulted.
+     *
+     * \return *this
+     */
+    file& operator=(file&&) noexcept = default;
+
+    /**
+     * Schedule the reads as interactive I/O.
+     *
+     * \param io the scheduler, null for none
+     * \see archive::set_io_scheduler
+     */
+    inline void set_io_scheduler(std::shared_ptr<io_scheduler> io) noexcept
+    {
+        io_ = std::move(io);
+    }
+
+    /**
+     * Read some data.
+     *
+     * \param data the destination buffer
+     * \param length the length
+     * \return the number of bytes written or -1 on failure
+     */
+    inline int read(void* data, uint64_t length) noexcept
+    {
+        detail::io_guard guard(io_.get(), io_class::interactive, length);
+
+        if (stream_)
+            return stream_->read(data, length);
+
+        return zip_fread(handle_.get(), data, length);
+    }
+
+    /**
+     * Read some data to a fixed size array.
+     *
+     * \param data the array
+     * \return the number of bytes written or -1 on failure
+     */
+    template <size_t Size>
+    inline int read(char (&data)[Size]) noexcept
+    {
+        return read(data, Size);
+    }
+
+    /**
+     * Optimized function for reading all characters with only one allocation.
+     * Ideal for combining with archive::stat.
+     *
+     * \param length the length of the file
+     * \return the whole string
+     * \see archive::stat
+     */
+    std::string read(uint64_t length)
+    {
+        std::string result;
+
+        result.resize(length);
+        auto count = read(&result[0], length);
+
+        if (count < 0)
+            return "";
+
+        result.resize(count);
+
+        return result;
+    }
+};
+
+/**
+ * Add a file to the archive using a binary buffer.
+ *
+ * \param data the buffer
+ * \return the source to add
+ */
+inline source source_buffer(std::string data) noexcept
+{
+    return [data = std::move(data)] (struct zip* archive) -> struct zip_source* {
+        auto size = data.size();
+        auto ptr = static_cast<char*>(std::malloc(size));
+
+        if (ptr == nullptr)
+            throw std::runtime_error(std::strerror(errno));
+
+        std::memcpy(ptr, data.data(), size);
+
+        auto src = zip_source_buffer(archive, ptr, size, 1);
+
+        if (src == nullptr) {
+            std::free(ptr);
+            throw std::runtime_error(zip_strerror(archive));
+        }
+
+        return src;
+    };
+}
+
+/**
+ * Add a file to the archive from the disk.
+ *
+ * \param path the path to the file
+ * \param start the position where to start
+ * \param length the number of bytes to copy
+ * \return the source to add
+ */
+inline source source_file(std::string path, uint64_t start = 0, int64_t length = -1) noexcept
+{
+    return [path = std::move(path), start, length] (struct zip* archive) -> struct zip_source* {
+        auto src = zip_source_file(archive, path.c_str(), start, length);
+
+        if (src == nullptr)
+            throw std::runtime_error(zip_strerror(archive));
+
+        return src;
+    };
+}
+
+#if !defined(_WIN32)
+
+/**
+ * Add a file to the archive from the disk through memory mappings.
+ *
+ * Unlike source_file, the data is copied straight from the page cache to
+ * the compressor instead of going through stdio buffers, which pays off on
+ * large inputs. The range is mapped by windows of 64 MiB read sequentially.
+ *
+ * The file must not be truncated before the archive is closed.
+ *
+ * Only available on POSIX systems.
+ *
+ * \param path the path to the file
+ * \param start the position where to start
+ * \param length the number of bytes to copy, -1 for the rest of the file
+ * \return the source to add
+ * \see source_file
+ */
+inline source source_mmap(std::string path, uint64_t start = 0, int64_t length = -1) noexcept
+{
+    return [path = std::move(path), start, length] (struct zip* archive) -> struct zip_source* {
+        struct ::stat st;
+
+        if (::stat(path.c_str(), &st) < 0)
+            throw std::runtime_error(path + ": " + std::strerror(errno));
+
+        uint64_t size = st.st_size;
+
+        if (start > size || (length >= 0 && static_cast<uint64_t>(length) > size - start))
+            throw std::runtime_error(path + ": " + std::strerror(EINVAL));
+
+        std::unique_ptr<detail::mmap_source> state(new detail::mmap_source);
+
+        state->path = path;
+        state->start = start;
+        state->size = length >= 0 ? static_cast<uint64_t>(length) : size - start;
+        state->mtime = st.st_mtime;
+        zip_error_init(&state->error);
+
+        auto src = zip_source_function(archive, detail::mmap_source::callback, state.get());
+
+        if (src == nullptr) {
+            zip_error_fini(&state->error);
+            throw std::runtime_error(zip_strerror(archive));
+        }
+
+        state.release();
+
+        return src;
+    };
+}
+
+#endif
+
+/**
+ * \brief Wrapper for stat as pointer.
+ */
+class stat_ptr {
+private:
+    stat stat_;
+
+public:
+    /**
+     * Constructor.
+     *
+     * \param stat the file stat
+     */
+    inline stat_ptr(stat stat) noexcept
+        : stat_(stat)
+    {
+    }
+
+    /**
+     * Get the reference.
+     *
+     * \return the reference
+     */
+    inline stat& operator*() noexcept
+    {
+        return stat_;
+    }
+
+    /**
+     * Get the reference.
+     *
+     * \return the reference
+     */
+    inline const stat& operator*() const noexcept
+    {
+        return stat_;
+    }
+
+    /**
+     * Access the object.
+     *
+     * \return the pointer
+     */
+    inline stat* operator->() noexcept
+    {
+        return &stat_;
+    }
+
+    /**
+     * Access the object.
+     *
+     * \return the pointer
+     */
+    inline const stat* operator->() const noexcept
+    {
+        return &stat_;
+    }
+};
+
+/**
+ * \brief Policy for entries whose name already exists, see archive::merge.
+ */
+enum class merge_policy {
+    error,              //!< throw std::runtime_error
+    keep_first,         //!< keep the entry already present
+    keep_last           //!< replace it with the new entry
+};
+
+/**
+ * \brief Match returned by archive::search.
+ */
+struct search_hit {
+    uint64_t index;     //!< the entry index
+    uint64_t offset;    //!< the offset in the uncompressed content
+};
+
+/**
+ * \brief Extra field of an entry, see archive::extra_fields.
+ */
+struct extra_field {
+    uint64_t index;         //!< the entry index
+    const uint8_t* data;    //!< the field data, without its header
+    uint16_t size;          //!< the data size
+};
+
+/**
+ * \brief Extended timestamps (0x5455) of entries, one row per entry having
+ * the field.
+ *
+ * Missing times are set to -1, the central directory usually only has the
+ * modification time.
+ */
+struct timestamp_table {
+    std::vector<uint64_t> index;    //!< the entry indices
+    std::vector<int64_t> mtime;     //!< modification times
+    std::vector<int64_t> atime;     //!< access times
+    std::vector<int64_t> ctime;     //!< creation times
+};
+
+/**
+ * \brief Info-ZIP Unix owners (0x7875) of entries, one row per entry having
+ * the field.
+ */
+struct owner_table {
+    std::vector<uint64_t> index;    //!< the entry indices
+    std::vector<uint64_t> uid;      //!< user ids
+    std::vector<uint64_t> gid;      //!< group ids
+};
+
+/**
+ * \brief Kind of change, see diff.
+ */
+enum class diff_kind {
+    added,              //!< only in the new archive
+    removed,            //!< only in the old archive
+    modified,           //!< in both, with different content
+    unchanged           //!< in both, with the same content
+};
+
+/**
+ * \brief Entry compared by diff.
+ */
+struct diff_entry {
+    std::string name;   //!< the entry name
+    diff_kind kind;     //!< the kind of change
+    int64_t from;       //!< index in the old archive or -1
+    int64_t to;         //!< index in the new archive or -1
+};
+
+/**
+ * \brief Options of archive::extract.
+ */
+struct extract_options {
+    /**
+     * Skip the files which are already up to date: same size and
+     * modification time, or same size and CRC-32.
+     */
+    bool incremental{false};
+
+    /**
+     * Keep a journal next to the directory (directory + ".journal") so
+     * that an interrupted extraction resumes where it stopped. Completed
+     * entries are re-checked like incremental ones and partially written
+     * large entries continue from their last checkpoint if their CRC-32
+     * matches. The journal is removed on success.
+     */
+    bool journal{false};
+
+    /**
+     * Create sparse files: the 4 KiB blocks which are all zeros are not
+     * written, the file system leaves holes there. Saves disk bandwidth and
+     * space for mostly empty files such as disk images.
+     */
+    bool sparse{false};
+
+    /**
+     * The maximum number of threads, 0 for the executor one.
+     */
+    unsigned concurrency{0};
+};
+
+/**
+ * \brief Summary of archive::extract.
+ */
+struct extract_result {
+    uint64_t extracted{0};      //!< number of files written
+    uint64_t skipped{0};        //!< number of files already up to date
+    uint64_t logical{0};        //!< bytes of content extracted
+    uint64_t written{0};        //!< bytes written, less than logical if sparse
+};
+
+/**
+ * \brief Position of an archive inside a larger file.
+ */
+struct byte_range {
+    uint64_t offset{0};         //!< first byte of the archive
+    uint64_t length{0};         //!< size of the archive
+};
+
+/**
+ * \brief Function of archive::transform.
+ *
+ * It receives the entry information and its content to modify in place,
+ * and returns false to leave the entry out of the output. It's called
+ * from several threads at once.
+ */
+using transform_function = std::function<bool (const stat&, std::string&)>;
+
+/**
+ * \brief Selection of entries by index and name for the bulk operations
+ * (archive::remove_if, ...).
+ */
+using entry_predicate = std::function<bool (uint64_t, const std::string&)>;
+
+/**
+ * Make a predicate selecting the names matching a glob pattern.
+ *
+ * \param pattern the pattern, '*' and '?' are supported
+ * \return the predicate
+ */
+inline entry_predicate glob(std::string pattern)
+{
+    return [pattern = std::move(pattern)] (uint64_t, const std::string& name) {
+        return detail::glob_match(pattern, name);
+    };
+}
+
+/**
+ * \brief Failure of one entry in a bulk operation.
+ */
+struct bulk_error {
+    uint64_t index;             //!< the entry index
+    std::string message;        //!< the libzip error
+};
+
+/**
+ * \brief Summary of a bulk operation.
+ */
+struct bulk_result {
+    uint64_t applied{0};                //!< number of entries changed
+    std::vector<bulk_error> errors;     //!< entries which could not be changed
+};
+
+/**
+ * \brief Prediction of archive::estimate, bounds are 95% confidence
+ * intervals of the sampling.
+ */
+struct estimate_result {
+    uint64_t size{0};           //!< expected size of the archive in bytes
+    uint64_t size_low{0};       //!< lower bound of size
+    uint64_t size_high{0};      //!< upper bound of size
+    double cpu{0};              //!< expected compression CPU time in seconds
+    double cpu_low{0};          //!< lower bound of cpu
+    double cpu_high{0};         //!< upper bound of cpu
+    uint64_t sampled{0};        //!< number of bytes read for the estimate
+    uint64_t unknown{0};        //!< bytes which could not be sampled, counted as stored
+};
+
+/**
+ * \brief Options of archive::transform.
+ */
+struct transform_options {
+    /**
+     * Entries to give to the transform function, all files if empty. The
+     * others are copied without being decompressed.
+     */
+    std::function<bool (const stat&)> filter;
+
+    /**
+     * The maximum number of uncompressed bytes held in memory at once, an
+     * entry larger than that is still processed alone.
+     */
+    uint64_t max_memory{64U << 20};
+
+    /**
+     * The maximum number of threads, 0 for the executor one.
+     */
+    unsigned concurrency{0};
+};
+
+/**
+ * \brief Entries to keep in memory, see archive::preload.
+ *
+ * An entry is pinned if it matches any of the criteria.
+ */
+struct preload_policy {
+    std::vector<std::string> patterns;  //!< glob patterns ('*' and '?')
+    std::vector<std::string> names;     //!< exact names
+    std::vector<uint64_t> indices;      //!< exact indices, e.g. from read_trace
+    uint64_t max_size{0};               //!< pin entries up to this size, 0 to disable
+    uint64_t max_memory{std::numeric_limits<uint64_t>::max()}; //!< memory budget in bytes
+};
+
+/**
+ * \brief Progress of archive::preload.
+ */
+struct preload_status {
+    uint64_t total{0};                  //!< number of entries selected
+    uint64_t loaded{0};                 //!< number of entries pinned so far
+    uint64_t bytes{0};                  //!< memory used by pinned entries
+    bool done{false};                   //!< true when the preload is finished
+    std::string error;                  //!< the error that stopped it, if any
+};
+
+/**
+ * \brief Progress of archive::prefetch.
+ */
+struct prefetch_status {
+    uint64_t entries{0};                //!< number of entries found in the archive
+    uint64_t ranges{0};                 //!< number of merged ranges issued so far
+    uint64_t bytes{0};                  //!< bytes covered by the issued ranges
+    bool done{false};                   //!< true when the readahead is issued
+};
+
+namespace detail {
+
+/**
+ * \brief Entries pinned in memory, filled by a background thread.
+ */
+class pin_store {
+private:
+    mutable std::mutex mutex_;
+    std::map<uint64_t, std::shared_ptr<const std::string>> entries_;
+    preload_status status_;
+    std::atomic<bool> cancel_{false};
+    std::thread thread_;
+
+    void run(const std::string& path, const std::shared_ptr<const reader>& view, const preload_policy& policy)
+    {
+        readonly_handle handle(open(path, view, ZIP_RDONLY), zip_discard);
+        const std::unordered_set<std::string> names(policy.names.begin(), policy.names.end());
+        const std::unordered_set<uint64_t> indices(policy.indices.begin(), policy.indices.end());
+        std::vector<std::pair<uint64_t, uint64_t>> selected;
+
+        for (int64_t i = 0, n = zip_get_num_entries(handle.get(), 0); i < n; ++i) {
+            struct zip_stat st;
+
+            if (zip_stat_index(handle.get(), i, 0, &st) < 0)
+                throw std::runtime_error(zip_strerror(handle.get()));
+
+            std::string name(st.name);
+
+            if ((policy.max_size > 0 && st.size <= policy.max_size) ||
+                names.count(name) > 0 ||
+                indices.count(i) > 0 ||
+                std::any_of(policy.patterns.begin(), policy.patterns.end(), [&] (const auto& p) {
+                    return glob_match(p, name);
+                }))
+                selected.emplace_back(i, st.size);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            status_.total = selected.size();
+        }
+
+        uint64_t budget = policy.max_memory;
+
+        for (const auto& entry : selected) {
+            if (cancel_)
+                break;
+            if (entry.second > budget)
+                continue;
+
+            auto data = std::make_shared<const std::string>(head(handle.get(), entry.first, entry.second));
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            budget -= data->size();
+            status_.bytes += data->size();
+            status_.loaded += 1;
+            entries_.emplace(entry.first, std::move(data));
+        }
+    }
+
+public:
+    /**
+     * Start loading the entries selected by policy.
+     *
+     * \param path the archive path
+     * \param view the archive bytes to open instead of path or null
+     * \param policy the policy
+     */
+    pin_store(std::string path, std::shared_ptr<const reader> view, preload_policy policy)
+    {
+        thread_ = std::thread([this, path = std::move(path), view = std::move(view), policy = std::move(policy)] () {
+            try {
+                run(path, view, policy);
+            } catch (const std::exception& ex) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                status_.error = ex.what();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            status_.done = true;
+        });
+    }
+
+    /**
+     * Stop loading and wait for the thread.
+     */
+    ~pin_store()
+    {
+        cancel_ = true;
+        wait();
+    }
+
+    /**
+     * Wait until loading is finished.
+     */
+    void wait()
+    {
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    /**
+     * Get the progress.
+     *
+     * \return the status
+     */
+    preload_status status() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return status_;
+    }
+
+    /**
+     * Get a pinned entry.
+     *
+     * \param index the entry index
+     * \return the content or null if not pinned
+     */
+    std::shared_ptr<const std::string> find(uint64_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(index);
+
+        return it == entries_.end() ? nullptr : it->second;
+    }
+
+    /**
+     * Drop a pinned entry, e.g. because it was modified.
+     *
+     * \param index the entry index
+     */
+    void erase(uint64_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(index);
+
+        if (it != entries_.end()) {
+            status_.bytes -= it->second->size();
+            status_.loaded -= 1;
+            entries_.erase(it);
+        }
+    }
+};
+
+/**
+ * Convert a MS-DOS date and time to a time_t, as libzip does.
+ *
+ * \param time the MS-DOS time
+ * \param date the MS-DOS date
+ * \return the local time
+ */
+inline std::time_t dos_to_time(uint16_t time, uint16_t date) noexcept
+{
+    std::tm tm{};
+
+    tm.tm_year = ((date >> 9) & 127) + 80;
+    tm.tm_mon = ((date >> 5) & 15) - 1;
+    tm.tm_mday = date & 31;
+    tm.tm_hour = (time >> 11) & 31;
+    tm.tm_min = (time >> 5) & 63;
+    tm.tm_sec = (time & 31) * 2;
+    tm.tm_isdst = -1;
+
+    return std::mktime(&tm);
+}
+
+/**
+ * \brief Stream reading an entry directly from the archive bytes.
+ *
+ * Supports stored and deflated entries. The CRC is checked at the end, the
+ * read returning -1 on mismatch like zip_fread.
+ */
+class inflate_stream : public stream {
+private:
+    std::shared_ptr<const reader> reader_;
+    uint64_t offset_;
+    uint64_t remaining_;
+    uint32_t crc_{0};
+    uint32_t expected_;
+    bool deflated_;
+    bool end_{false};
+    z_stream z_{};
+    std::vector<uint8_t> input_;
+
+    inflate_stream(const inflate_stream&) = delete;
+    inflate_stream& operator=(const inflate_stream&) = delete;
+
+    bool check(const void* data, std::size_t length) noexcept
+    {
+        crc_ = ::crc32(crc_, static_cast<const Bytef*>(data), static_cast<uInt>(length));
+
+        return !end_ || crc_ == expected_;
+    }
+
+public:
+    /**
+     * Constructor.
+     *
+     * \param reader the archive bytes
+     * \param offset the position of the entry data
+     * \param entry the entry
+     * \throw std::runtime_error if the entry can't be read this way
+     */
+    inflate_stream(std::shared_ptr<const reader> reader, uint64_t offset, const cd_entry& entry)
+        : reader_(std::move(reader))
+        , offset_(offset)
+        , remaining_(entry.comp_size)
+        , expected_(entry.crc)
+        , deflated_(entry.method == ZIP_CM_DEFLATE)
+    {
+        if (entry.flags & 1)
+            throw std::runtime_error("encrypted entries are not supported in concurrent mode");
+        if (entry.method != ZIP_CM_STORE && entry.method != ZIP_CM_DEFLATE)
+            throw std::runtime_error("compression method not supported in concurrent mode");
+
+        if (deflated_) {
+            input_.resize(65536);
+
+            if (inflateInit2(&z_, -MAX_WBITS) != Z_OK)
+                throw std::runtime_error("inflateInit2 failed");
+        } else
+            end_ = remaining_ == 0;
+    }
+
+    /**
+     * Release zlib resources.
+     */
+    ~inflate_stream()
+    {
+        if (deflated_)
+            inflateEnd(&z_);
+    }
+
+    /**
+     * \copydoc stream::read
+     */
+    int64_t read(void* data, uint64_t length) noexcept override
+    {
+        length = std::min<uint64_t>(length, std::numeric_limits<uInt>::max());
+
+        try {
+            if (!deflated_) {
+                auto count = reader_->read(data, std::min(length, remaining_), offset_);
+
+                offset_ += count;
+                remaining_ -= count;
+                end_ = remaining_ == 0;
+
+                return check(data, count) ? static_cast<int64_t>(count) : -1;
+            }
+
+            z_.next_out = static_cast<Bytef*>(data);
+            z_.avail_out = static_cast<uInt>(length);
+
+            while (z_.avail_out > 0 && !end_) {
+                if (z_.avail_in == 0 && remaining_ > 0) {
+                    auto count = reader_->read(input_.data(), std::min<uint64_t>(input_.size(), remaining_), offset_);
+
+                    if (count == 0)
+                        return -1;
+
+                    offset_ += count;
+                    remaining_ -= count;
+                    z_.next_in = input_.data();
+                    z_.avail_in = static_cast<uInt>(count);
+                }
+
+                auto ret = inflate(&z_, Z_NO_FLUSH);
+
+                if (ret == Z_STREAM_END)
+                    end_ = true;
+                else if (ret != Z_OK)
+                    return -1;
+            }
+
+            auto count = length - z_.avail_out;
+
+            return check(data, count) ? static_cast<int64_t>(count) : -1;
+        } catch (...) {
+            return -1;
+        }
+    }
+};
+
+/**
+ * \brief Immutable copy of the archive metadata, see
+ * archive::enable_concurrent_reads.
+ */
+class snapshot {
+private:
+    std::shared_ptr<const reader> reader_;
+    central_directory cd_;
+    std::vector<char> names_;
+    std::vector<libzip::stat> stats_;
+    std::vector<uint64_t> sorted_;
+
+public:
+    /**
+     * Read the central directory and index the names.
+     *
+     * \param reader the archive bytes
+     * \throw std::runtime_error on errors
+     */
+    explicit snapshot(std::shared_ptr<const reader> reader)
+        : reader_(std::move(reader))
+        , cd_(*reader_)
+    {
+        const auto& entries = cd_.entries();
+        std::vector<std::size_t> offsets;
+
+        for (const auto& entry : entries) {
+            offsets.push_back(names_.size());
+            names_.insert(names_.end(), cd_.name(entry), cd_.name(entry) + entry.name_size);
+            names_.push_back('\0');
+        }
+
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            libzip::stat st;
+
+            zip_stat_init(&st);
+            st.valid = ZIP_STAT_NAME | ZIP_STAT_INDEX | ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE |
+                ZIP_STAT_MTIME | ZIP_STAT_CRC | ZIP_STAT_COMP_METHOD | ZIP_STAT_ENCRYPTION_METHOD;
+            st.name = &names_[offsets[i]];
+            st.index = i;
+            st.size = entries[i].size;
+            st.comp_size = entries[i].comp_size;
+            st.mtime = dos_to_time(entries[i].dos_time, entries[i].dos_date);
+            st.crc = entries[i].crc;
+            st.comp_method = entries[i].method;
+            st.encryption_method = (entries[i].flags & 1) ? ZIP_EM_UNKNOWN : ZIP_EM_NONE;
+            stats_.push_back(st);
+        }
+
+        // A sorted directory is searched in place.
+        if (cd_.sorted())
+            return;
+
+        for (std::size_t i = 0; i < entries.size(); ++i)
+            sorted_.push_back(i);
+
+        std::sort(sorted_.begin(), sorted_.end(), [this] (auto lhs, auto rhs) {
+            auto cmp = std::strcmp(stats_[lhs].name, stats_[rhs].name);
+
+            return cmp < 0 || (cmp == 0 && lhs < rhs);
+        });
+    }
+
+    /**
+     * Get the central directory.
+     *
+     * \return the central directory
+     */
+    inline const central_directory& directory() const noexcept
+    {
+        return cd_;
+    }
+
+    /**
+     * Get the number of entries.
+     *
+     * \return the number
+     */
+    inline std::size_t size() const noexcept
+    {
+        return stats_.size();
+    }
+
+    /**
+     * Get information about an entry.
+     *
+     * \param index the entry index
+     * \return the information
+     * \throw std::runtime_error if index is out of range
+     */
+    inline const libzip::stat& at(uint64_t index) const
+    {
+        if (index >= stats_.size())
+            throw std::runtime_error("Invalid argument");
+
+        return stats_[index];
+    }
+
+    /**
+     * Locate an entry by name, matched exactly.
+     *
+     * \param name the name
+     * \return the index or -1 if not found
+     */
+    int64_t find(const char* name) const noexcept
+    {
+        if (cd_.sorted())
+            return cd_.find(name, std::strlen(name));
+
+        auto it = std::lower_bound(sorted_.begin(), sorted_.end(), name, [this] (auto index, auto name) {
+            return std::strcmp(stats_[index].name, name) < 0;
+        });
+
+        if (it == sorted_.end() || std::strcmp(stats_[*it].name, name) != 0)
+            return -1;
+
+        // Like libzip, the first entry of duplicate names wins.
+        return *it;
+    }
+
+    /**
+     * Open an entry.
+     *
+     * \param index the entry index
+     * \return the stream
+     * \throw std::runtime_error on errors
+     */
+    std::unique_ptr<stream> open(uint64_t index) const
+    {
+        at(index);
+
+        const auto& entry = cd_.entries()[index];
+
+        return std::unique_ptr<stream>(new inflate_stream(reader_, cd_.data_offset(*reader_, entry), entry));
+    }
+};
+
+/**
+ * Append a LEB128 varint.
+ *
+ * \param out the destination
+ * \param value the value
+ */
+inline void put_varint(std::string& out, uint64_t value)
+{
+    do {
+        out.push_back(static_cast<char>((value & 0x7f) | (value > 0x7f ? 0x80 : 0)));
+        value >>= 7;
+    } while (value != 0);
+}
+
+/**
+ * Decode a LEB128 varint.
+ *
+ * \param p the position, advanced past the varint
+ * \param end the end of the data
+ * \return the value
+ * \throw std::runtime_error if truncated
+ */
+inline uint64_t get_varint(const char*& p, const char* end)
+{
+    uint64_t value = 0;
+
+    for (unsigned shift = 0; ; shift += 7) {
+        if (p == end || shift >= 64)
+            throw std::runtime_error("invalid varint");
+
+        auto byte = static_cast<unsigned char>(*p++);
+
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+}
+
+/**
+ * Compute a binary delta between two contents.
+ *
+ * The old content is indexed by 32 bytes blocks, the new one is scanned
+ * with a rolling hash and every match is extended in both directions. The
+ * delta is a list of operations: 0 + varint length + bytes to insert, or 1
+ * + varint offset + varint length to copy from the old content.
+ *
+ * \param from the old content
+ * \param to the new content
+ * \return the delta
+ */
+inline std::string make_delta(const std::string& from, const std::string& to)
+{
+    constexpr std::size_t block = 32;
+    constexpr uint64_t base = 1099511628211ULL;
+
+    std::string delta, literal;
+
+    auto flush = [&] () {
+        if (!literal.empty()) {
+            delta.push_back(0);
+            put_varint(delta, literal.size());
+            delta += literal;
+            literal.clear();
+        }
+    };
+    auto hash = [&] (const char* p) {
+        uint64_t h = 0;
+
+        for (std::size_t i = 0; i < block; ++i)
+            h = h * base + static_cast<unsigned char>(p[i]);
+
+        return h;
+    };
+
+    if (from.size() < block || to.size() < block) {
+        literal = to;
+        flush();
+
+        return delta;
+    }
+
+    uint64_t power = 1;
+    std::unordered_map<uint64_t, std::size_t> blocks;
+
+    for (std::size_t i = 1; i < block; ++i)
+        power *= base;
+    for (std::size_t offset = 0; offset + block <= from.size(); offset += block)
+        blocks.emplace(hash(&from[offset]), offset);
+
+    std::size_t i = 0;
+    uint64_t h = hash(&to[0]);
+
+    while (i + block <= to.size()) {
+        auto it = blocks.find(h);
+
+        if (it == blocks.end() || std::memcmp(&from[it->second], &to[i], block) != 0) {
+            literal.push_back(to[i]);
+
+            if (i + block < to.size())
+                h = (h - static_cast<unsigned char>(to[i]) * power) * base + static_cast<unsigned char>(to[i + block]);
+
+            ++ i;
+            continue;
+        }
+
+        auto src = it->second;
+        auto dst = i;
+        auto length = block;
+
+        while (src > 0 && !literal.empty() && from[src - 1] == literal.back()) {
+            literal.pop_back();
+            -- src;
+            -- dst;
+            ++ length;
+        }
+        while (src + length < from.size() && dst + length < to.size() && from[src + length] == to[dst + length])
+            ++ length;
+
+        flush();
+        delta.push_back(1);
+        put_varint(delta, src);
+        put_varint(delta, length);
+        i = dst + length;
+
+        if (i + block <= to.size())
+            h = hash(&to[i]);
+    }
+
+    literal.append(to, i, std::string::npos);
+    flush();
+
+    return delta;
+}
+
+/**
+ * Rebuild a content from the old one and a delta from make_delta.
+ *
+ * \param from the old content
+ * \param delta the delta
+ * \return the new content
+ * \throw std::runtime_error if the delta is invalid
+ */
+inline std::string apply_delta(const std::string& from, const std::string& delta)
+{
+    std::string result;
+    auto p = delta.data();
+    auto end = delta.data() + delta.size();
+
+    while (p != end) {
+        auto op = *p++;
+
+        if (op == 0) {
+            auto length = get_varint(p, end);
+
+            if (length > static_cast<uint64_t>(end - p))
+                throw std::runtime_error("invalid delta");
+
+            result.append(p, length);
+            p += length;
+        } else if (op == 1) {
+            auto offset = get_varint(p, end);
+            auto length = get_varint(p, end);
+
+            if (offset > from.size() || length > from.size() - offset)
+                throw std::runtime_error("invalid delta");
+
+            result.append(from, offset, length);
+        } else
+            throw std::runtime_error("invalid delta");
+    }
+
+    return result;
+}
+
+/**
+ * \brief Kind of patch record, see make_patch.
+ */
+enum class patch_op : char {
+    copy,           //!< raw copy of an old entry
+    delta,          //!< delta against an old entry
+    whole           //!< whole uncompressed content
+};
+
+/**
+ * \brief Record of a patch.
+ *
+ * On disk: op, varint name size, name, then for copy the varint old index
+ * and old CRC, for delta the varint old index, old CRC, new CRC, mtime and
+ * the delta, for whole the varint CRC, mtime and the content. Bytes strings
+ * are prefixed by their varint size.
+ *
+ * The data is only filled to encode a record, the reader gives its place
+ * in the patch instead.
+ */
+struct patch_record {
+    patch_op op;
+    std::string name;
+    uint64_t index{0};
+    uint32_t old_crc{0};
+    uint32_t crc{0};
+    uint64_t mtime{0};
+    std::string data;
+    uint64_t offset{0};
+    uint64_t size{0};
+};
+
+/**
+ * Get the magic number at the beginning of patches.
+ *
+ * \return the 4 bytes magic
+ */
+inline const char* patch_magic() noexcept
+{
+    return "ZPT1";
+}
+
+/**
+ * Encode a patch record.
+ *
+ * \param record the record
+ * \return the bytes
+ */
+inline std::string encode(const patch_record& record)
+{
+    std::string out;
+
+    out.push_back(static_cast<char>(record.op));
+    put_varint(out, record.name.size());
+    out += record.name;
+
+    if (record.op != patch_op::whole) {
+        put_varint(out, record.index);
+        put_varint(out, record.old_crc);
+    }
+    if (record.op != patch_op::copy) {
+        put_varint(out, record.crc);
+        put_varint(out, record.mtime);
+        put_varint(out, record.data.size());
+        out += record.data;
+    }
+
+    return out;
+}
+
+/**
+ * Move the position of a stdio file with 64-bit offsets.
+ *
+ * \param fp the file
+ * \param offset the offset
+ * \param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * \return 0 on success
+ */
+inline int seek_file(std::FILE* fp, int64_t offset, int whence) noexcept
+{
+#if defined(_WIN32)
+    return _fseeki64(fp, offset, whence);
+#else
+    return ::fseeko(fp, static_cast<off_t>(offset), whence);
+#endif
+}
+
+/**
+ * Get the position of a stdio file with 64-bit offsets.
+ *
+ * \param fp the file
+ * \return the position or -1 on errors
+ */
+inline int64_t tell_file(std::FILE* fp) noexcept
+{
+#if defined(_WIN32)
+    return _ftelli64(fp);
+#else
+    return ::ftello(fp);
+#endif
+}
+
+/**
+ * \brief Sequential reader of a patch file.
+ */
+class patch_reader {
+private:
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp_;
+    uint64_t size_{0};
+
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+
+        for (unsigned shift = 0; ; shift += 7) {
+            auto ch = std::fgetc(fp_.get());
+
+            if (ch == EOF || shift >= 64)
+                throw std::runtime_error("truncated patch");
+
+            value |= static_cast<uint64_t>(ch & 0x7f) << shift;
+
+            if ((ch & 0x80) == 0)
+                return value;
+        }
+    }
+
+    uint64_t tell()
+    {
+        auto pos = tell_file(fp_.get());
+
+        if (pos < 0)
+            throw std::runtime_error(std::strerror(errno));
+
+        return pos;
+    }
+
+    uint64_t length()
+    {
+        auto length = varint();
+
+        if (length > size_ - tell())
+            throw std::runtime_error("truncated patch");
+
+        return length;
+    }
+
+    std::string bytes()
+    {
+        std::string data(length(), '\0');
+
+        if (!data.empty() && std::fread(&data[0], data.size(), 1, fp_.get()) != 1)
+            throw std::runtime_error("truncated patch");
+
+        return data;
+    }
+
+    uLong crc(uint64_t length)
+    {
+        char buffer[65536];
+        auto crc = ::crc32(0, Z_NULL, 0);
+
+        while (length > 0) {
+            auto count = static_cast<std::size_t>(std::min<uint64_t>(length, sizeof (buffer)));
+
+            if (std::fread(buffer, count, 1, fp_.get()) != 1)
+                throw std::runtime_error("truncated patch");
+
+            crc = ::crc32(crc, reinterpret_cast<const Bytef*>(buffer), count);
+            length -= count;
+        }
+
+        return crc;
+    }
+
+public:
+    /**
+     * Open a patch and check its header.
+     *
+     * \param path the path
+     * \param count the expected number of entries of the old archive
+     * \throw std::runtime_error on errors
+     */
+    patch_reader(const std::string& path, uint64_t count)
+        : fp_(std::fopen(path.c_str(), "rb"), std::fclose)
+    {
+        char magic[4];
+
+        if (!fp_)
+            throw std::runtime_error(path + ": " + std::strerror(errno));
+        if (seek_file(fp_.get(), 0, SEEK_END) != 0)
+            throw std::runtime_error(path + ": " + std::strerror(errno));
+
+        size_ = tell();
+        std::rewind(fp_.get());
+
+        if (std::fread(magic, sizeof (magic), 1, fp_.get()) != 1 || std::memcmp(magic, patch_magic(), 4) != 0)
+            throw std::runtime_error("invalid patch");
+        if (varint() != count)
+            throw std::runtime_error("patch does not match the archive");
+    }
+
+    /**
+     * Read the next record.
+     *
+     * The data is not read: its offset and size are set instead, after
+     * checking whole content against its CRC.
+     *
+     * \param record the record to fill
+     * \return false at the end of the patch
+     * \throw std::runtime_error on errors
+     */
+    bool next(patch_record& record)
+    {
+        auto op = std::fgetc(fp_.get());
+
+        if (op == EOF)
+            return false;
+        if (op > static_cast<int>(patch_op::whole))
+            throw std::runtime_error("invalid patch");
+
+        record = patch_record();
+        record.op = static_cast<patch_op>(op);
+        record.name = bytes();
+
+        if (record.op != patch_op::whole) {
+            record.index = varint();
+            record.old_crc = static_cast<uint32_t>(varint());
+        }
+        if (record.op != patch_op::copy) {
+            record.crc = static_cast<uint32_t>(varint());
+            record.mtime = varint();
+            record.size = length();
+            record.offset = tell();
+
+            if (record.op == patch_op::delta) {
+                if (seek_file(fp_.get(), static_cast<int64_t>(record.size), SEEK_CUR) != 0)
+                    throw std::runtime_error(std::strerror(errno));
+            } else if (crc(record.size) != record.crc)
+                throw std::runtime_error("corrupted patch");
+        }
+
+        return true;
+    }
+};
+
+/**
+ * Read the data of a patch record.
+ *
+ * \param path the patch path
+ * \param record the record
+ * \return the data
+ * \throw std::runtime_error on errors
+ */
+inline std::string read_patch_data(const std::string& path, const patch_record& record)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp(std::fopen(path.c_str(), "rb"), std::fclose);
+    std::string data(record.size, '\0');
+
+    if (!fp || seek_file(fp.get(), static_cast<int64_t>(record.offset), SEEK_SET) != 0)
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    if (!data.empty() && std::fread(&data[0], data.size(), 1, fp.get()) != 1)
+        throw std::runtime_error("truncated patch");
+
+    return data;
+}
+
+/**
+ * Read the whole content of an opened entry.
+ *
+ * \param input the file
+ * \param size the entry size
+ * \return the content
+ * \throw std::runtime_error on read errors or if the size does not match
+ */
+inline std::string read_all(file& input, uint64_t size)
+{
+    std::string result(size, '\0');
+    uint64_t total = 0;
+
+    while (total < size) {
+        auto length = std::min<uint64_t>(size - total, std::numeric_limits<int>::max());
+        auto count = input.read(&result[total], length);
+
+        if (count < 0)
+            throw std::runtime_error("read failed");
+        if (count == 0)
+            throw std::runtime_error("unexpected end of entry");
+
+        total += count;
+    }
+
+    char extra;
+
+    if (input.read(&extra, 1) != 0)
+        throw std::runtime_error("entry larger than its size");
+
+    return result;
+}
+
+#if !defined(_WIN32)
+
+/**
+ * Create a directory and its parents.
+ *
+ * \param path the path
+ * \throw std::runtime_error on errors
+ */
+inline void make_directories(const std::string& path)
+{
+    for (std::size_t pos = 0; pos != std::string::npos; ) {
+        pos = path.find('/', pos + 1);
+
+        auto dir = path.substr(0, pos);
+
+        if (::mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST)
+            throw std::runtime_error(dir + ": " + std::strerror(errno));
+    }
+}
+
+/**
+ * Check that an entry name stays inside the extraction directory.
+ *
+ * \param name the name
+ * \throw std::runtime_error if absolute or containing ..
+ */
+inline void check_name(const std::string& name)
+{
+    if (name.empty() || name[0] == '/')
+        throw std::runtime_error(name + ": unsafe entry name");
+
+    for (std::size_t begin = 0; begin <= name.size(); ) {
+        auto end = std::min(name.find('/', begin), name.size());
+
+        if (name.compare(begin, end - begin, "..") == 0)
+            throw std::runtime_error(name + ": unsafe entry name");
+
+        begin = end + 1;
+    }
+}
+
+/**
+ * Set the modification time of a file, keeping its access time.
+ *
+ * \param path the path
+ * \param mtime the time
+ * \throw std::runtime_error on errors
+ */
+inline void set_mtime(const std::string& path, std::time_t mtime)
+{
+    struct timespec times[2]{};
+
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+
+    if (::utimensat(AT_FDCWD, path.c_str(), times, 0) < 0)
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+}
+
+/**
+ * Compute the CRC-32 of a file on the disk.
+ *
+ * \param path the path
+ * \param length the maximum number of bytes to read
+ * \return the CRC
+ * \throw std::runtime_error on errors
+ */
+inline uint32_t crc32_file(const std::string& path, uint64_t length = std::numeric_limits<uint64_t>::max())
+{
+    file_reader reader(path);
+    std::vector<char> buffer(1U << 20);
+    uLong crc = ::crc32(0, nullptr, 0);
+
+    length = std::min(length, reader.size());
+
+    for (uint64_t offset = 0; offset < length; ) {
+        auto count = reader.read(buffer.data(), std::min<uint64_t>(buffer.size(), length - offset), offset);
+
+        if (count == 0)
+            break;
+
+        crc = ::crc32(crc, reinterpret_cast<const Bytef*>(buffer.data()), static_cast<uInt>(count));
+        offset += count;
+    }
+
+    return static_cast<uint32_t>(crc);
+}
+
+/**
+ * Check if a file on the disk has the content of an entry.
+ *
+ * A file with the same size and modification time is assumed identical,
+ * otherwise a file with the same size is compared by CRC-32 and its
+ * modification time is updated on match so that the next check is cheap.
+ *
+ * \param path the path
+ * \param st the entry information
+ * \return true if up to date
+ * \throw std::runtime_error on errors
+ */
+inline bool up_to_date(const std::string& path, const libzip::stat& st)
+{
+    struct ::stat sb;
+
+    if (::stat(path.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode) || static_cast<uint64_t>(sb.st_size) != st.size)
+        return false;
+    if (sb.st_mtime == st.mtime)
+        return true;
+    if (crc32_file(path) != st.crc)
+        return false;
+
+    set_mtime(path, st.mtime);
+
+    return true;
+}
+
+/**
+ * \brief File being extracted.
+ */
+class output_file {
+private:
+    int fd_;
+
+    output_file(const output_file&) = delete;
+    output_file& operator=(const output_file&) = delete;
+
+public:
+    /**
+     * Create or open the file.
+     *
+     * \param path the path
+     * \param truncate true to empty it
+     * \throw std::runtime_error on errors
+     */
+    explicit output_file(const std::string& path, bool truncate = true)
+        : fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0666))
+    {
+        if (fd_ < 0)
+            throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+
+    /**
+     * Take ownership of an open descriptor.
+     *
+     * \param fd the descriptor
+     */
+    explicit output_file(int fd) noexcept
+        : fd_(fd)
+    {
+    }
+
+    /**
+     * Get the descriptor.
+     *
+     * \return the descriptor
+     */
+    inline int fd() const noexcept
+    {
+        return fd_;
+    }
+
+    /**
+     * Give up the ownership of the descriptor.
+     *
+     * \return the descriptor, the caller closes it
+     */
+    int release() noexcept
+    {
+        auto fd = fd_;
+
+        fd_ = -1;
+
+        return fd;
+    }
+
+    /**
+     * Close the file if not already done.
+     */
+    ~output_file()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    /**
+     * Write all bytes.
+     *
+     * \param data the data
+     * \param length the number of bytes
+     * \throw std::runtime_error on errors
+     */
+    void write(const void* data, std::size_t length)
+    {
+        auto p = static_cast<const char*>(data);
+
+        while (length > 0) {
+            auto count = ::write(fd_, p, length);
+
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                throw std::runtime_error(std::strerror(errno));
+
+            p += count;
+            length -= count;
+        }
+    }
+
+    /**
+     * Write bytes at some position, without moving the end of the file.
+     *
+     * \param data the data
+     * \param length the number of bytes
+     * \param offset the position
+     * \throw std::runtime_error on errors
+     */
+    void write_at(const void* data, std::size_t length, uint64_t offset)
+    {
+        auto p = static_cast<const char*>(data);
+
+        while (length > 0) {
+            auto count = ::pwrite(fd_, p, length, offset);
+
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                throw std::runtime_error(std::strerror(errno));
+
+            p += count;
+            offset += count;
+            length -= count;
+        }
+    }
+
+    /**
+     * Move the write position forward, leaving a hole if nothing is
+     * written there.
+     *
+     * \param length the number of bytes
+     * \throw std::runtime_error on errors
+     */
+    void skip(uint64_t length)
+    {
+        if (::lseek(fd_, length, SEEK_CUR) < 0)
+            throw std::runtime_error(std::strerror(errno));
+    }
+
+    /**
+     * Set the size and continue writing at the end.
+     *
+     * \param size the new size
+     * \throw std::runtime_error on errors
+     */
+    void resize(uint64_t size)
+    {
+        if (::ftruncate(fd_, size) < 0 || ::lseek(fd_, size, SEEK_SET) < 0)
+            throw std::runtime_error(std::strerror(errno));
+    }
+
+    /**
+     * Flush the data to the disk.
+     *
+     * \throw std::runtime_error on errors
+     */
+    void sync()
+    {
+        if (::fsync(fd_) < 0)
+            throw std::runtime_error(std::strerror(errno));
+    }
+
+    /**
+     * Close the file, reporting errors.
+     *
+     * \throw std::runtime_error on errors
+     */
+    void close()
+    {
+        auto fd = fd_;
+
+        fd_ = -1;
+
+        if (::close(fd) < 0)
+            throw std::runtime_error(std::strerror(errno));
+    }
+};
+
+/**
+ * \brief Progress journal of a resumable extraction.
+ *
+ * The journal starts with a magic number and the size and modification
+ * time of the archive, then holds 'C' + varint index records for completed
+ * entries and 'P' + varint index + varint offset records for the bytes of a
+ * large entry known to be on the disk. Completed records are synced in
+ * batches, a lost batch only means re-checking those files.
+ */
+class journal {
+private:
+    std::mutex mutex_;
+    std::string path_;
+    int fd_{-1};
+    std::string buffer_;
+    unsigned pending_{0};
+
+    static constexpr unsigned batch = 256;
+
+    static std::string header(const std::string& archive)
+    {
+        struct ::stat sb;
+        std::string header("ZJR1");
+
+        if (::stat(archive.c_str(), &sb) < 0)
+            throw std::runtime_error(archive + ": " + std::strerror(errno));
+
+        put_varint(header, sb.st_size);
+        put_varint(header, sb.st_mtime);
+
+        return header;
+    }
+
+    void sync_locked()
+    {
+        if (!buffer_.empty() && ::write(fd_, buffer_.data(), buffer_.size()) != static_cast<ssize_t>(buffer_.size()))
+            throw std::runtime_error(path_ + ": " + std::strerror(errno));
+        if (::fsync(fd_) < 0)
+            throw std::runtime_error(path_ + ": " + std::strerror(errno));
+
+        buffer_.clear();
+        pending_ = 0;
+    }
+
+public:
+    /**
+     * Entries already done by a previous run.
+     */
+    std::vector<char> completed;
+
+    /**
+     * Bytes already written of large entries by a previous run.
+     */
+    std::unordered_map<uint64_t, uint64_t> partial;
+
+    /**
+     * Load the journal if it matches the archive, otherwise start a new
+     * one.
+     *
+     * \param path the journal path
+     * \param archive the archive path
+     * \param count the number of entries
+     * \throw std::runtime_error on errors
+     */
+    journal(std::string path, const std::string& archive, std::size_t count)
+        : path_(std::move(path))
+        , completed(count)
+    {
+        auto head = header(archive);
+        std::string data;
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+        if (fd_ < 0)
+            throw std::runtime_error(path_ + ": " + std::strerror(errno));
+
+        char buf[65536];
+
+        for (ssize_t n; (n = ::read(fd_, buf, sizeof (buf))) > 0; )
+            data.append(buf, n);
+
+        if (data.compare(0, head.size(), head) != 0) {
+            if (::ftruncate(fd_, 0) < 0 || ::lseek(fd_, 0, SEEK_SET) < 0)
+                throw std::runtime_error(path_ + ": " + std::strerror(errno));
+
+            buffer_ = head;
+            sync_locked();
+
+            return;
+        }
+
+        // A torn record at the end is ignored.
+        try {
+            auto p = data.data() + head.size();
+            auto end = data.data() + data.size();
+
+            while (p != end) {
+                auto type = *p++;
+                auto index = get_varint(p, end);
+
+                if (type == 'P')
+                    partial[index] = get_varint(p, end);
+                else if (type == 'C' && index < count)
+                    completed[index] = 1;
+            }
+        } catch (const std::exception&) {
+        }
+    }
+
+    /**
+     * Sync the pending records.
+     */
+    ~journal()
+    {
+        if (fd_ >= 0) {
+            try {
+                std::lock_guard<std::mutex> lock(mutex_);
+                sync_locked();
+            } catch (...) {
+            }
+
+            ::close(fd_);
+        }
+    }
+
+    /**
+     * Record a completed entry.
+     *
+     * \param index the entry index
+     * \throw std::runtime_error on errors
+     */
+    void complete(uint64_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        buffer_.push_back('C');
+        put_varint(buffer_, index);
+
+        if (++pending_ >= batch)
+            sync_locked();
+    }
+
+    /**
+     * Record the bytes of an entry already synced to the disk.
+     *
+     * \param index the entry index
+     * \param offset the number of bytes
+     * \throw std::runtime_error on errors
+     */
+    void checkpoint(uint64_t index, uint64_t offset)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        buffer_.push_back('P');
+        put_varint(buffer_, index);
+        put_varint(buffer_, offset);
+        sync_locked();
+    }
+
+    /**
+     * Remove the journal once everything is extracted.
+     */
+    void finish() noexcept
+    {
+        ::close(fd_);
+        fd_ = -1;
+        ::unlink(path_.c_str());
+    }
+};
+
+/**
+ * Check if a block is all zeros.
+ *
+ * The block is compared to itself shifted by 16 bytes once the first 16
+ * are known to be zero, which lets memcmp do the scan with the vector
+ * instructions of the C library.
+ *
+ * \param data the block
+ * \param length the size, at least 16
+ * \return true if every byte is zero
+ */
+inline bool all_zero(const char* data, std::size_t length) noexcept
+{
+    assert(length >= 16);
+
+    for (std::size_t i = 0; i < 16; ++i)
+        if (data[i] != 0)
+            return false;
+
+    return std::memcmp(data, data + 16, length - 16) == 0;
+}
+
+/**
+ * \brief Bytes handled by extract_entry.
+ */
+struct extract_count {
+    uint64_t logical{0};        //!< bytes of content produced
+    uint64_t written{0};        //!< bytes written to the disk
+};
+
+/**
+ * Write an entry to a file on the disk and set its modification time.
+ *
+ * When resuming, the bytes already on the disk are kept if their CRC-32
+ * matches the beginning of the entry, otherwise the file is rewritten.
+ * With a journal, large entries are synced and checkpointed regularly.
+ *
+ * When sparse, the file blocks which are all zeros are skipped instead of
+ * written so that the file system leaves holes there.
+ *
+ * \param handle the archive
+ * \param st the entry information
+ * \param path the destination
+ * \param resume the number of bytes already written by a previous run
+ * \param log the journal or null
+ * \param io the scheduler of the background writes or null
+ * \param sparse skip the zero blocks
+ * \return the bytes produced by this call and the ones written
+ * \throw std::runtime_error on errors
+ */
+inline extract_count extract_entry(struct zip* handle,
+                                   const libzip::stat& st,
+                                   const std::string& path,
+                                   uint64_t resume = 0,
+                                   journal* log = nullptr,
+                                   io_scheduler* io = nullptr,
+                                   bool sparse = false)
+{
+    constexpr uint64_t interval = 64U << 20;
+    constexpr std::size_t block = 4096;
+
+    using zip_file_ptr = std::unique_ptr<struct zip_file, int (*)(struct zip_file*)>;
+
+    auto open = [&] () {
+        zip_file_ptr file(zip_fopen_index(handle, st.index, 0), zip_fclose);
+
+        if (!file)
+            throw std::runtime_error(zip_strerror(handle));
+
+        return file;
+    };
+
+    auto file = open();
+    std::vector<char> buffer(65536);
+    uint64_t written = 0;
+
+    auto read = [&] (std::size_t length) {
+        auto count = zip_fread(file.get(), buffer.data(), length);
+
+        if (count < 0)
+            throw std::runtime_error(zip_file_strerror(file.get()));
+
+        return static_cast<std::size_t>(count);
+    };
+
+    if (resume > 0 && resume <= st.size) {
+        struct ::stat sb;
+        uLong crc = ::crc32(0, nullptr, 0);
+
+        while (written < resume) {
+            auto count = read(std::min<uint64_t>(buffer.size(), resume - written));
+
+            if (count == 0)
+                break;
+
+            crc = ::crc32(crc, reinterpret_cast<const Bytef*>(buffer.data()), static_cast<uInt>(count));
+            written += count;
+        }
+
+        if (written != resume || ::stat(path.c_str(), &sb) < 0 ||
+            static_cast<uint64_t>(sb.st_size) < resume || crc32_file(path, resume) != crc) {
+            file = open();
+            written = 0;
+        }
+    }
+
+    output_file out(path, written == 0);
+    uint64_t checkpoint = written;
+    extract_count result;
+
+    out.resize(written);
+
+    auto store = [&] (const char* data, std::size_t length) {
+        io_guard guard(io, io_class::background, length);
+
+        out.write(data, length);
+        result.written += length;
+    };
+
+    for (std::size_t count; (count = read(buffer.size())) > 0; ) {
+        if (!sparse)
+            store(buffer.data(), count);
+
+        // Runs of whole zero blocks, aligned on the file offset, are skipped.
+        for (std::size_t pos = 0; sparse && pos < count; ) {
+            auto end = pos;
+            auto zero = false;
+
+            while (end < count) {
+                auto length = std::min<std::size_t>(count - end, block - (written + end) % block);
+                auto is_zero = length == block && all_zero(&buffer[end], length);
+
+                if (end > pos && is_zero != zero)
+                    break;
+
+                zero = is_zero;
+                end += length;
+            }
+
+            if (zero)
+                out.skip(end - pos);
+            else
+                store(&buffer[pos], end - pos);
+
+            pos = end;
+        }
+
+        written += count;
+        result.logical += count;
+
+        if (log && written - checkpoint >= interval) {
+            out.sync();
+            log->checkpoint(st.index, written);
+            checkpoint = written;
+        }
+    }
+
+    // A trailing hole is only a size.
+    if (sparse)
+        out.resize(written);
+
+    out.close();
+    set_mtime(path, st.mtime);
+
+    return result;
+}
+
+/**
+ * \brief Advisory lock on a file, shared with other processes.
+ */
+class file_lock {
+private:
+    int fd_{-1};
+    bool locked_{false};
+
+    file_lock(const file_lock&) = delete;
+    file_lock& operator=(const file_lock&) = delete;
+
+public:
+    /**
+     * Create the file if needed and lock it exclusively.
+     *
+     * If the file was unlinked or replaced while waiting, the lock is
+     * taken again on the file now at that path.
+     *
+     * \param path the lock file
+     * \param wait false to give up if it's already locked
+     * \throw std::runtime_error on errors
+     */
+    file_lock(const std::string& path, bool wait = true)
+    {
+        for (;;) {
+            if ((fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+                throw std::runtime_error(path + ": " + std::strerror(errno));
+
+            int ret;
+
+            while ((ret = ::flock(fd_, LOCK_EX | (wait ? 0 : LOCK_NB))) < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0) {
+                auto error = errno;
+
+                if (error == EWOULDBLOCK)
+                    return;
+
+                ::close(fd_);
+                throw std::runtime_error(path + ": " + std::strerror(error));
+            }
+
+            struct ::stat locked, current;
+
+            if (::fstat(fd_, &locked) == 0 && ::stat(path.c_str(), &current) == 0 &&
+                locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+                locked_ = true;
+                return;
+            }
+
+            ::close(fd_);
+        }
+    }
+
+    /**
+     * Release the lock.
+     */
+    ~file_lock()
+    {
+        ::close(fd_);
+    }
+
+    /**
+     * \return true if the lock is held
+     */
+    bool locked() const noexcept
+    {
+        return locked_;
+    }
+};
+
+/**
+ * Remove the least recently used files of a cache directory.
+ *
+ * Files are ordered by modification time, which the caches refresh on
+ * each use. The lock files, temporary files and hidden files are not part
+ * of the cache, and files whose lock is held by someone are skipped.
+ *
+ * The lock file of a removed file is unlinked while both the directory
+ * and the file locks are held; file_lock takes the lock again on the new
+ * file when the one it waited for was unlinked.
+ *
+ * \param directory the cache directory
+ * \param max_size the size to get under
+ * \param keep a file never to remove
+ * \throw std::runtime_error on errors
+ */
+inline void evict(const std::string& directory, uint64_t max_size, const std::string& keep)
+{
+    struct item {
+        std::string path;
+        std::time_t mtime;
+        uint64_t size;
+    };
+
+    auto reserved = [] (const std::string& name) {
+        for (auto suffix : {".lock", ".tmp"}) {
+            auto length = std::strlen(suffix);
+
+            if (name.size() >= length && name.compare(name.size() - length, length, suffix) == 0)
+                return true;
+        }
+
+        return name.empty() || name[0] == '.';
+    };
+
+    file_lock lock(directory + "/.lock");
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(::opendir(directory.c_str()), ::closedir);
+    std::vector<item> items;
+    uint64_t total = 0;
+
+    if (!dir)
+        throw std::runtime_error(directory + ": " + std::strerror(errno));
+
+    while (auto ent = ::readdir(dir.get())) {
+        std::string name(ent->d_name);
+        struct ::stat sb;
+
+        if (reserved(name))
+            continue;
+
+        auto path = directory + "/" + name;
+
+        if (::stat(path.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode))
+            continue;
+
+        items.push_back({path, sb.st_mtime, static_cast<uint64_t>(sb.st_size)});
+        total += sb.st_size;
+    }
+
+    std::sort(items.begin(), items.end(), [] (const item& a, const item& b) {
+        return a.mtime < b.mtime;
+    });
+
+    for (const auto& i : items) {
+        if (total <= max_size)
+            break;
+        if (i.path == keep)
+            continue;
+
+        // Skip the files being written or checked right now.
+        file_lock entry(i.path + ".lock", false);
+
+        if (!entry.locked())
+            continue;
+
+        ::unlink(i.path.c_str());
+        ::unlink((i.path + ".lock").c_str());
+        total -= i.size;
+    }
+}
+
+#if defined(__linux__)
+
+/**
+ * Copy a range of a file to the current position of another one in the
+ * kernel.
+ *
+ * Tries copy_file_range, then sendfile when the kernel refuses to copy
+ * across file systems, then falls back to reading and writing.
+ *
+ * \param in the source descriptor
+ * \param offset the source position
+ * \param out the destination
+ * \param length the number of bytes
+ * \throw std::runtime_error on errors or if the source is too short
+ */
+inline void copy_range(int in, uint64_t offset, output_file& out, uint64_t length)
+{
+    auto pos = static_cast<off_t>(offset);
+    auto unsupported = [] (int error) {
+        return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP;
+    };
+
+    for (bool kernel = true, range = true; length > 0; ) {
+        ssize_t count;
+
+        if (range)
+            count = ::copy_file_range(in, &pos, out.fd(), nullptr, length, 0);
+        else if (kernel)
+            count = ::sendfile(out.fd(), in, &pos, std::min<uint64_t>(length, 1U << 30));
+        else {
+            char buffer[65536];
+
+            count = ::pread(in, buffer, std::min<uint64_t>(length, sizeof (buffer)), pos);
+
+            if (count > 0) {
+                out.write(buffer, count);
+                pos += count;
+            }
+        }
+
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && range && unsupported(errno)) {
+            range = false;
+            continue;
+        }
+        if (count < 0 && kernel && unsupported(errno)) {
+            kernel = false;
+            continue;
+        }
+        if (count < 0)
+            throw std::runtime_error(std::strerror(errno));
+        if (count == 0)
+            throw std::runtime_error("unexpected end of file");
+
+        length -= count;
+    }
+}
+
+#endif
+
+/**
+ * Mark the smallest name of an archive about to be written with the
+ * sorted_field, removing stale marks from the other entries.
+ *
+ * \param handle the archive
+ * \throw std::runtime_error on errors
+ */
+inline void mark_sorted(struct zip* handle)
+{
+    std::vector<std::pair<std::string, uint64_t>> names;
+
+    for (zip_int64_t i = 0, n = zip_get_num_entries(handle, 0); i < n; ++i)
+        if (auto name = zip_get_name(handle, i, ZIP_FL_ENC_RAW))
+            names.emplace_back(name, i);
+
+    if (names.empty())
+        return;
+
+    std::stable_sort(names.begin(), names.end(), [] (const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    uLong crc = ::crc32(0, nullptr, 0);
+
+    for (const auto& name : names)
+        crc = ::crc32(crc, reinterpret_cast<const Bytef*>(name.first.c_str()), name.first.size() + 1);
+
+    uint8_t field[13] = {1};
+
+    for (int i = 0; i < 8; ++i)
+        field[1 + i] = static_cast<uint8_t>(static_cast<uint64_t>(names.size()) >> (8 * i));
+    for (int i = 0; i < 4; ++i)
+        field[9 + i] = static_cast<uint8_t>(crc >> (8 * i));
+
+    for (const auto& name : names) {
+        auto index = name.second;
+        auto count = zip_file_extra_fields_count_by_id(handle, index, sorted_field, ZIP_FL_CENTRAL);
+
+        if (index == names[0].second) {
+            zip_uint16_t length = 0;
+            auto data = count > 0 ? zip_file_extra_field_get_by_id(handle, index, sorted_field, 0, &length, ZIP_FL_CENTRAL) : nullptr;
+
+            if (data && length == sizeof (field) && std::memcmp(data, field, sizeof (field)) == 0)
+                continue;
+            if (zip_file_extra_field_set(handle, index, sorted_field, count > 0 ? 0 : ZIP_EXTRA_FIELD_NEW,
+                                         field, sizeof (field), ZIP_FL_CENTRAL) < 0)
+                throw std::runtime_error(zip_strerror(handle));
+        } else if (count > 0 && zip_file_extra_field_delete_by_id(handle, index, sorted_field, ZIP_EXTRA_FIELD_ALL, ZIP_FL_CENTRAL) < 0)
+            throw std::runtime_error(zip_strerror(handle));
+    }
+}
+
+/**
+ * Reorder the central directory of a written archive by name, in place.
+ *
+ * Only the records move, the local headers and the end of central
+ * directory stay the same.
+ *
+ * \param path the archive path
+ * \throw std::runtime_error on errors
+ */
+inline void sort_directory(const std::string& path)
+{
+    file_reader reader(path);
+    central_directory cd(reader);
+    const auto& entries = cd.entries();
+    std::vector<std::size_t> order(entries.size());
+
+    for (std::size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    auto less = [&] (std::size_t lhs, std::size_t rhs) {
+        return compare_names(cd.name(entries[lhs]), entries[lhs].name_size,
+                             cd.name(entries[rhs]), entries[rhs].name_size) < 0;
+    };
+
+    if (std::is_sorted(order.begin(), order.end(), less))
+        return;
+
+    std::stable_sort(order.begin(), order.end(), less);
+    std::vector<uint8_t> data;
+
+    for (auto i : order) {
+        auto record = cd.data() + entries[i].record;
+
+        data.insert(data.end(), record, record + cd.record_size(entries[i]));
+    }
+
+    output_file out(path, false);
+
+    out.write_at(data.data(), data.size(), cd.offset());
+    out.close();
+}
+
+/**
+ * \brief Directory of extracted entries shared by processes.
+ *
+ * A file is named after the archive identity (device, inode, size and
+ * modification time) and the CRC and size of the entry. It's extracted
+ * under a per-file lock to a temporary name then renamed, so readers only
+ * ever see complete files. The modification time of the files records
+ * their last use for the LRU eviction.
+ */
+class extraction_cache {
+private:
+    std::string directory_;
+    std::string identity_;
+    uint64_t max_size_;
+
+public:
+    /**
+     * Use a cache directory for an archive.
+     *
+     * \param directory the directory, created if needed
+     * \param archive the archive path
+     * \param max_size the maximum total size, 0 for no limit
+     * \throw std::runtime_error on errors
+     */
+    extraction_cache(std::string directory, const std::string& archive, uint64_t max_size)
+        : directory_(std::move(directory))
+        , max_size_(max_size)
+    {
+        struct ::stat sb;
+        char buffer[32];
+
+        if (::stat(archive.c_str(), &sb) < 0)
+            throw std::runtime_error(archive + ": " + std::strerror(errno));
+
+        // FNV-1a.
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (uint64_t value : {static_cast<uint64_t>(sb.st_dev),
+                               static_cast<uint64_t>(sb.st_ino),
+                               static_cast<uint64_t>(sb.st_size),
+                               static_cast<uint64_t>(sb.st_mtime)}) {
+            for (int i = 0; i < 8; ++i) {
+                hash ^= (value >> (i * 8)) & 0xff;
+                hash *= 1099511628211ULL;
+            }
+        }
+
+        std::snprintf(buffer, sizeof (buffer), "%016llx", static_cast<unsigned long long>(hash));
+        identity_ = buffer;
+        make_directories(directory_);
+    }
+
+    /**
+     * Get the file of an entry, extracting it if it's not there yet.
+     *
+     * \param handle the archive
+     * \param st the entry information
+     * \return the path
+     * \throw std::runtime_error on errors
+     */
+    std::string materialize(struct zip* handle, const libzip::stat& st) const
+    {
+        char buffer[64];
+
+        std::snprintf(buffer, sizeof (buffer), "-%08x-%llx",
+            static_cast<unsigned>(st.crc), static_cast<unsigned long long>(st.size));
+
+        auto path = directory_ + "/" + identity_ + buffer;
+
+        {
+            file_lock lock(path + ".lock");
+            struct ::stat sb;
+
+            // Another process may have extracted it while we waited, the
+            // CRC catches files damaged since.
+            if (::stat(path.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode) ||
+                static_cast<uint64_t>(sb.st_size) != st.size || crc32_file(path) != st.crc) {
+                auto temporary = path + ".tmp";
+                zip_uint8_t opsys;
+                zip_uint32_t attributes;
+                mode_t mode = 0444;
+
+                ::unlink(temporary.c_str());
+                extract_entry(handle, st, temporary);
+
+                if (zip_file_get_external_attributes(handle, st.index, 0, &opsys, &attributes) == 0 &&
+                    opsys == ZIP_OPSYS_UNIX && (attributes >> 16) & 0111)
+                    mode = 0555;
+
+                if (::chmod(temporary.c_str(), mode) < 0 || ::rename(temporary.c_str(), path.c_str()) < 0)
+                    throw std::runtime_error(path + ": " + std::strerror(errno));
+            }
+
+            // Mark as recently used.
+            ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        }
+
+        if (max_size_ > 0)
+            evict(directory_, max_size_, path);
+
+        return path;
+    }
+};
+
+/**
+ * \brief SHA-256 (FIPS 180-4), used to name content-addressed files.
+ */
+class sha256 {
+private:
+    uint32_t state_[8]{
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t block_[64];
+    std::size_t pending_{0};
+    uint64_t length_{0};
+
+    static uint32_t rotr(uint32_t x, int n) noexcept
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress(const uint8_t* p) noexcept
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        uint32_t w[64];
+
+        for (int i = 0; i < 16; ++i)
+            w[i] = static_cast<uint32_t>(p[4 * i]) << 24 | static_cast<uint32_t>(p[4 * i + 1]) << 16 |
+                   static_cast<uint32_t>(p[4 * i + 2]) << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; ++i)
+            w[i] = w[i - 16] + (rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                   w[i - 7] + (rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+
+        for (int i = 0; i < 64; ++i) {
+            auto t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+        state_[5] += f;
+        state_[6] += g;
+        state_[7] += h;
+    }
+
+public:
+    /**
+     * Hash more bytes.
+     *
+     * \param data the bytes
+     * \param length the number of bytes
+     */
+    void update(const void* data, std::size_t length) noexcept
+    {
+        auto p = static_cast<const uint8_t*>(data);
+
+        length_ += length;
+
+        while (length > 0) {
+            if (pending_ == 0 && length >= 64) {
+                compress(p);
+                p += 64;
+                length -= 64;
+                continue;
+            }
+
+            auto count = std::min(length, 64 - pending_);
+
+            std::memcpy(block_ + pending_, p, count);
+            pending_ += count;
+            p += count;
+            length -= count;
+
+            if (pending_ == 64) {
+                compress(block_);
+                pending_ = 0;
+            }
+        }
+    }
+
+    /**
+     * Finish the hash, the object must not be updated afterwards.
+     *
+     * \return the digest in hexadecimal
+     */
+    std::string hex()
+    {
+        static const char digits[] = "0123456789abcdef";
+        const uint64_t bits = length_ * 8;
+        uint8_t tail[8];
+
+        for (int i = 0; i < 8; ++i)
+            tail[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+
+        update("\x80", 1);
+
+        while (pending_ != 56)
+            update("", 1);
+
+        update(tail, 8);
+
+        std::string result;
+
+        for (auto word : state_)
+            for (int shift = 28; shift >= 0; shift -= 4)
+                result.push_back(digits[(word >> shift) & 15]);
+
+        return result;
+    }
+};
+
+/**
+ * \brief Raw source over a blob of the compressed blob cache.
+ *
+ * The stat reports the compression method, sizes and CRC so libzip writes
+ * the bytes as they are. The blob is opened by blob_cache::lookup under its
+ * lock, so an eviction before the archive is written only unlinks the name.
+ */
+struct blob_source {
+    static constexpr uint64_t header_size = 24;
+
+    libzip::stat st;
+    std::unique_ptr<file_reader> file;
+    uint64_t offset{0};
+    zip_error_t error;
+
+    static zip_int64_t callback(void* state, void* data, zip_uint64_t length, zip_source_cmd_t cmd)
+    {
+        auto self = static_cast<blob_source*>(state);
+
+        try {
+            switch (cmd) {
+            case ZIP_SOURCE_OPEN:
+                self->offset = 0;
+                return 0;
+            case ZIP_SOURCE_READ: {
+                auto count = self->file->read(data, std::min(length, self->st.comp_size - self->offset),
+                                              header_size + self->offset);
+
+                self->offset += count;
+
+                return count;
+            }
+            case ZIP_SOURCE_CLOSE:
+                return 0;
+            case ZIP_SOURCE_STAT: {
+                auto st = ZIP_SOURCE_GET_ARGS(zip_stat_t, data, length, &self->error);
+
+                if (st == nullptr)
+                    return -1;
+
+                *st = self->st;
+
+                return sizeof (zip_stat_t);
+            }
+            case ZIP_SOURCE_ERROR:
+                return zip_error_to_data(&self->error, data, length);
+            case ZIP_SOURCE_FREE:
+                zip_error_fini(&self->error);
+                delete self;
+                return 0;
+            case ZIP_SOURCE_SUPPORTS:
+                return ZIP_SOURCE_SUPPORTS_READABLE;
+            default:
+                zip_error_set(&self->error, ZIP_ER_OPNOTSUPP, 0);
+                return -1;
+            }
+        } catch (const std::exception&) {
+            zip_error_set(&self->error, cmd == ZIP_SOURCE_OPEN ? ZIP_ER_OPEN : ZIP_ER_READ, errno);
+            return -1;
+        }
+    }
+};
+
+/**
+ * \brief Directory of deflated data shared by processes and builds.
+ *
+ * A blob is named after the SHA-256 of the uncompressed content and the
+ * compression level. It holds a 24 bytes header (magic, CRC, size and
+ * compressed size) then the raw deflate stream. Blobs are written under a
+ * per-blob lock to a temporary name then renamed.
+ */
+class blob_cache {
+private:
+    std::string directory_;
+    uint64_t max_size_;
+    int level_;
+
+    struct digest {
+        std::string hash;
+        uLong crc{::crc32(0, nullptr, 0)};
+        uint64_t size{0};
+    };
+
+    // Read a whole source, calling fn(data, length) on each chunk.
+    template <typename Function>
+    static void read(zip_source* src, Function&& fn)
+    {
+        std::vector<char> buffer(1U << 20);
+
+        if (zip_source_open(src) < 0)
+            throw std::runtime_error(zip_error_strerror(zip_source_error(src)));
+
+        zip_int64_t count;
+
+        while ((count = zip_source_read(src, buffer.data(), buffer.size())) > 0)
+            fn(buffer.data(), static_cast<std::size_t>(count));
+
+        zip_source_close(src);
+
+        if (count < 0)
+            throw std::runtime_error(zip_error_strerror(zip_source_error(src)));
+    }
+
+    static digest hash(zip_source* src)
+    {
+        digest d;
+        sha256 sha;
+
+        read(src, [&] (const char* data, std::size_t length) {
+            sha.update(data, length);
+            d.crc = ::crc32(d.crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(length));
+            d.size += length;
+        });
+
+        d.hash = sha.hex();
+
+        return d;
+    }
+
+    void store(zip_source* src, const digest& d, const std::string& path) const
+    {
+        auto temporary = path + ".tmp";
+        output_file out(temporary);
+        std::vector<char> compressed(1U << 20);
+        std::string header(blob_source::header_size, '\0');
+        z_stream zs{};
+
+        if (deflateInit2(&zs, level_, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+
+        std::unique_ptr<z_stream, int (*)(z_stream*)> guard(&zs, deflateEnd);
+
+        auto pump = [&] (int flush) {
+            int ret;
+
+            do {
+                zs.next_out = reinterpret_cast<Bytef*>(compressed.data());
+                zs.avail_out = static_cast<uInt>(compressed.size());
+
+                if ((ret = deflate(&zs, flush)) == Z_STREAM_ERROR)
+                    throw std::runtime_error("deflate failed");
+
+                out.write(compressed.data(), compressed.size() - zs.avail_out);
+            } while (zs.avail_out == 0);
+
+            if (flush == Z_FINISH && ret != Z_STREAM_END)
+                throw std::runtime_error("deflate failed");
+        };
+
+        out.write(header.data(), header.size());
+        read(src, [&] (const char* data, std::size_t length) {
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            zs.avail_in = static_cast<uInt>(length);
+            pump(Z_NO_FLUSH);
+        });
+        pump(Z_FINISH);
+
+        // The compressed size is only known now.
+        std::memcpy(&header[0], "ZBL1", 4);
+
+        for (int i = 0; i < 4; ++i)
+            header[4 + i] = static_cast<char>(d.crc >> (i * 8));
+        for (int i = 0; i < 8; ++i) {
+            header[8 + i] = static_cast<char>(d.size >> (i * 8));
+            header[16 + i] = static_cast<char>(static_cast<uint64_t>(zs.total_out) >> (i * 8));
+        }
+
+        out.write_at(header.data(), header.size(), 0);
+        out.close();
+
+        if (::rename(temporary.c_str(), path.c_str()) < 0)
+            throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+
+    // Get the compressed size of a valid blob of the digest, or -1.
+    static int64_t check(const std::string& path, const digest& d)
+    {
+        uint8_t header[blob_source::header_size];
+
+        try {
+            file_reader file(path);
+
+            if (file.read(header, sizeof (header), 0) != sizeof (header) ||
+                std::memcmp(header, "ZBL1", 4) != 0 || le32(header + 4) != d.crc || le64(header + 8) != d.size ||
+                file.size() != sizeof (header) + le64(header + 16))
+                return -1;
+
+            return static_cast<int64_t>(le64(header + 16));
+        } catch (const std::exception&) {
+            return -1;
+        }
+    }
+
+public:
+    /**
+     * Use a blob cache directory.
+     *
+     * \param directory the directory, created if needed
+     * \param max_size the maximum total size, 0 for no limit
+     * \param level the zlib compression level
+     * \throw std::runtime_error on errors
+     */
+    blob_cache(std::string directory, uint64_t max_size, int level)
+        : directory_(std::move(directory))
+        , max_size_(max_size)
+        , level_(level)
+    {
+        make_directories(directory_);
+    }
+
+    /**
+     * Replace a source with the cached compressed data of its content,
+     * compressing and storing it first if needed.
+     *
+     * \param src the source, freed unless it's returned
+     * \return the raw source
+     * \throw std::runtime_error on errors
+     */
+    zip_source* lookup(zip_source* src) const
+    {
+        std::unique_ptr<zip_source, void (*)(zip_source*)> owner(src, zip_source_free);
+        libzip::stat st;
+
+        zip_stat_init(&st);
+        zip_source_stat(src, &st);
+
+        auto d = hash(src);
+        auto path = directory_ + "/" + d.hash + "-8-" + std::to_string(level_);
+        std::unique_ptr<blob_source> state(new blob_source);
+        int64_t comp_size;
+
+        {
+            file_lock lock(path + ".lock");
+
+            if ((comp_size = check(path, d)) < 0) {
+                store(src, d, path);
+
+                if ((comp_size = check(path, d)) < 0)
+                    throw std::runtime_error(path + ": invalid blob");
+            }
+
+            // Opened now, an eviction before the archive is written only removes the name.
+            state->file.reset(new file_reader(path));
+
+            // Mark as recently used.
+            ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        }
+
+        if (max_size_ > 0)
+            evict(directory_, max_size_, path);
+
+        auto mtime = (st.valid & ZIP_STAT_MTIME) ? st.mtime : std::time(nullptr);
+
+        zip_stat_init(&state->st);
+        state->st.valid = ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE | ZIP_STAT_CRC |
+                          ZIP_STAT_COMP_METHOD | ZIP_STAT_ENCRYPTION_METHOD | ZIP_STAT_MTIME;
+        state->st.size = d.size;
+        state->st.comp_size = comp_size;
+        state->st.crc = d.crc;
+        state->st.comp_method = ZIP_CM_DEFLATE;
+        state->st.encryption_method = ZIP_EM_NONE;
+        state->st.mtime = mtime;
+        zip_error_init(&state->error);
+
+        zip_error_t error;
+
+        zip_error_init(&error);
+
+        auto raw = zip_source_function_create(blob_source::callback, state.get(), &error);
+
+        if (raw == nullptr) {
+            std::string message = zip_error_strerror(&error);
+
+            zip_error_fini(&error);
+            zip_error_fini(&state->error);
+            throw std::runtime_error(message);
+        }
+
+        zip_error_fini(&error);
+        state.release();
+
+        return raw;
+    }
+};
+
+#endif
+
+/**
+ * Get the magic number at the beginning of access traces.
+ *
+ * \return the 4 bytes magic
+ */
+inline const char* trace_magic() noexcept
+{
+    return "ZTR1";
+}
+
+/**
+ * \brief Writes the indices of opened entries, see archive::record.
+ *
+ * The trace is the magic number followed by one LEB128 varint per open.
+ */
+class trace_recorder {
+private:
+    std::mutex mutex_;
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp_;
+
+public:
+    /**
+     * Create the trace file.
+     *
+     * \param path the path
+     * \throw std::runtime_error on errors
+     */
+    explicit trace_recorder(const std::string& path)
+        : fp_(std::fopen(path.c_str(), "wb"), std::fclose)
+    {
+        if (!fp_ || std::fwrite(trace_magic(), 4, 1, fp_.get()) != 1)
+            throw std::runtime_error(std::strerror(errno));
+    }
+
+    /**
+     * Append an index.
+     *
+     * \param index the entry index
+     */
+    void record(uint64_t index) noexcept
+    {
+        uint8_t buf[10];
+        std::size_t length = 0;
+
+        do {
+            buf[length++] = static_cast<uint8_t>((index & 0x7f) | (index > 0x7f ? 0x80 : 0));
+            index >>= 7;
+        } while (index != 0);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::fwrite(buf, length, 1, fp_.get());
+    }
+};
+
+/**
+ * \brief Background readahead of entries, see archive::prefetch.
+ */
+class prefetcher {
+private:
+    mutable std::mutex mutex_;
+    prefetch_status status_;
+    std::atomic<bool> cancel_{false};
+    std::thread thread_;
+
+    void run(const reader& reader, std::vector<uint64_t> indices)
+    {
+        constexpr uint64_t gap = 65536;
+
+        central_directory cd(reader);
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+
+        for (auto index : indices) {
+            if (index >= cd.entries().size())
+                continue;
+
+            const auto& entry = cd.entries()[index];
+            auto begin = cd.base() + entry.offset;
+
+            // Assume the local extra fields are the same as the central ones.
+            ranges.emplace_back(begin, begin + 30 + entry.name_size + entry.extra_size + entry.comp_size);
+        }
+
+        std::sort(ranges.begin(), ranges.end());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            status_.entries = ranges.size();
+        }
+
+        for (std::size_t i = 0; i < ranges.size() && !cancel_; ) {
+            auto begin = ranges[i].first;
+            auto end = ranges[i].second;
+
+            for (++i; i < ranges.size() && ranges[i].first <= end + gap; ++i)
+                end = std::max(end, ranges[i].second);
+
+            reader.prefetch(begin, end - begin);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            ++ status_.ranges;
+            status_.bytes += end - begin;
+        }
+    }
+
+public:
+    /**
+     * Start the readahead.
+     *
+     * \param source the archive
+     * \param indices the entries
+     */
+    prefetcher(std::shared_ptr<const reader> source, std::vector<uint64_t> indices)
+    {
+        thread_ = std::thread([this, source = std::move(source), indices = std::move(indices)] () {
+            try {
+                run(*source, std::move(indices));
+            } catch (...) {
+                // Only a hint, errors will show up when reading.
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            status_.done = true;
+        });
+    }
+
+    /**
+     * Stop and wait for the thread.
+     */
+    ~prefetcher()
+    {
+        cancel_ = true;
+        wait();
+    }
+
+    /**
+     * Wait until the readahead is issued.
+     */
+    void wait()
+    {
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    /**
+     * Get the progress.
+     *
+     * \return a copy of the status
+     */
+    prefetch_status status() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return status_;
+    }
+};
+
+/**
+ * \brief Source added to an archive and not written yet, kept for
+ * archive::estimate once enabled with archive::enable_estimate.
+ */
+struct pending_entry {
+    std::shared_ptr<struct zip_source> source;
+    int32_t method{ZIP_CM_DEFAULT};
+    uint32_t level{0};
+};
+
+/**
+ * Check if a source can seek, so that reading it now doesn't prevent
+ * reading it again when the archive is written.
+ *
+ * \param src the source, closed again on return
+ * \return true if seekable
+ */
+inline bool seekable(struct zip_source* src) noexcept
+{
+    if (zip_source_open(src) < 0)
+        return false;
+
+    auto ret = zip_source_seek(src, 0, SEEK_SET) == 0;
+
+    zip_source_close(src);
+
+    return ret;
+}
+
+/**
+ * Read a range of a seekable source.
+ *
+ * \param src the source, closed again on return
+ * \param offset the position
+ * \param length the maximum number of bytes
+ * \return the bytes, empty if the source can't seek to offset
+ * \throw std::runtime_error on errors
+ */
+inline std::string read_source(struct zip_source* src, uint64_t offset, uint64_t length)
+{
+    std::unique_ptr<struct zip_source, int (*)(struct zip_source*)> guard(nullptr, zip_source_close);
+    std::string data(static_cast<std::size_t>(length), '\0');
+    uint64_t count = 0;
+
+    if (zip_source_open(src) < 0)
+        throw std::runtime_error(zip_error_strerror(zip_source_error(src)));
+
+    guard.reset(src);
+
+    if (offset > 0 && zip_source_seek(src, offset, SEEK_SET) < 0)
+        return {};
+
+    for (zip_int64_t n; count < length; count += n) {
+        if ((n = zip_source_read(src, &data[count], length - count)) < 0)
+            throw std::runtime_error(zip_error_strerror(zip_source_error(src)));
+        if (n == 0)
+            break;
+    }
+
+    data.resize(count);
+
+    return data;
+}
+
+/**
+ * Compute the CRC-32 of some data of any size.
+ *
+ * \param data the data
+ * \return the CRC
+ */
+inline uLong checksum(const std::string& data) noexcept
+{
+    auto crc = ::crc32(0, nullptr, 0);
+
+    for (std::size_t pos = 0; pos < data.size(); ) {
+        auto length = static_cast<uInt>(std::min<std::size_t>(data.size() - pos, 1U << 30));
+
+        crc = ::crc32(crc, reinterpret_cast<const Bytef*>(data.data() + pos), length);
+        pos += length;
+    }
+
+    return crc;
+}
+
+/**
+ * Compress data with raw deflate, as stored in zip entries.
+ *
+ * \param data the data
+ * \param level the zlib level
+ * \return the compressed bytes
+ * \throw std::runtime_error on errors
+ */
+inline std::string deflate_raw(const std::string& data, int level)
+{
+    z_stream zs{};
+    std::string out;
+    char buffer[65536];
+    std::size_t pos = 0;
+    int flush, ret;
+
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("deflateInit2 failed");
+
+    do {
+        auto length = std::min<std::size_t>(data.size() - pos, 1U << 30);
+
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + pos));
+        zs.avail_in = static_cast<uInt>(length);
+        pos += length;
+        flush = pos == data.size() ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(buffer);
+            zs.avail_out = sizeof (buffer);
+
+            if ((ret = deflate(&zs, flush)) == Z_STREAM_ERROR) {
+                deflateEnd(&zs);
+                throw std::runtime_error("deflate failed");
+            }
+
+            out.append(buffer, sizeof (buffer) - zs.avail_out);
+        } while (zs.avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    deflateEnd(&zs);
+
+    if (ret != Z_STREAM_END)
+        throw std::runtime_error("deflate failed");
+
+    return out;
+}
+
+/**
+ * Get the CPU time used by the calling thread, or by the process where
+ * threads have no clock of their own.
+ *
+ * \return the time in seconds
+ */
+inline double cpu_time() noexcept
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+
+    if (::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+}
+
+/**
+ * Compress a block on its own with deflate.
+ *
+ * \param data the block
+ * \param level the zlib level
+ * \return the compressed size
+ */
+inline uint64_t deflated_size(const std::string& data, int level)
+{
+    z_stream zs{};
+    std::vector<Bytef> out(deflateBound(&zs, data.size()) + 64);
+
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("deflateInit2 failed");
+
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = out.data();
+    zs.avail_out = static_cast<uInt>(out.size());
+    deflate(&zs, Z_FINISH);
+
+    auto size = zs.total_out;
+
+    deflateEnd(&zs);
+
+    return size;
+}
+
+} // !detail
+
+/**
+ * Read an access trace written by archive::record.
+ *
+ * \param path the trace path
+ * \return the indices in the order they were opened
+ * \throw std::runtime_error on errors
+ */
+inline std::vector<uint64_t> read_trace(const std::string& path)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp(std::fopen(path.c_str(), "rb"), std::fclose);
+    char magic[4];
+
+    if (!fp)
+        throw std::runtime_error(std::strerror(errno));
+    if (std::fread(magic, sizeof (magic), 1, fp.get()) != 1 ||
+        std::memcmp(magic, detail::trace_magic(), sizeof (magic)) != 0)
+        throw std::runtime_error("invalid access trace");
+
+    std::vector<uint64_t> indices;
+    uint64_t value = 0;
+    unsigned shift = 0;
+
+    for (int ch; (ch = std::fgetc(fp.get())) != EOF; ) {
+        if (shift >= 64)
+            throw std::runtime_error("invalid access trace");
+
+        value |= static_cast<uint64_t>(ch & 0x7f) << shift;
+        shift += 7;
+
+        if ((ch & 0x80) == 0) {
+            indices.push_back(value);
+            value = 0;
+            shift = 0;
+        }
+    }
+
+    return indices;
+}
+
+/**
+ * Find an archive appended to another file (e.g. an executable).
+ *
+ * The end of central directory is searched from the end of the file and
+ * the beginning of the archive is deduced from the central directory
+ * position, so it works whether the offsets of the archive are relative
+ * to the archive or to the file.
+ *
+ * \param path the file path
+ * \return the range to give to archive
+ * \throw std::runtime_error if there is no archive at the end of the file
+ */
+inline byte_range find_embedded(const std::string& path)
+{
+    detail::file_reader reader(path);
+    detail::central_directory cd(reader);
+    byte_range range;
+
+    range.offset = cd.base();
+    range.length = cd.end() - cd.base();
+
+    return range;
+}
+
+/**
+ * \brief Safe wrapper on the struct zip structure.
+ */
+class archive {
+private:
+    std::string path_;
+
+    // Archive bytes when they are not a whole file (volumes, window).
+    std::shared_ptr<const detail::reader> view_;
+    std::unique_ptr<detail::pin_store> pins_;
+    std::unique_ptr<detail::trace_recorder> recorder_;
+    std::unique_ptr<detail::prefetcher> prefetcher_;
+    std::unique_ptr<const detail::snapshot> snapshot_;
+    // Central directory read on first use, possibly by several threads.
+    mutable std::unique_ptr<std::once_flag> directory_once_{new std::once_flag};
+    mutable std::unique_ptr<const detail::central_directory> directory_;
+    flags_t name_flags_{0};
+
+#if !defined(_WIN32)
+    std::unique_ptr<const detail::extraction_cache> cache_;
+    std::unique_ptr<const detail::blob_cache> blobs_;
+    bool sort_directory_{false};
+#endif
+
+    bool estimate_{false};
+
+    std::shared_ptr<executor> executor_;
+    std::shared_ptr<io_scheduler> io_;
+
+    // Sources added and not written yet.
+    std::unordered_map<uint64_t, detail::pending_entry> pending_;
+
+    // Archives raw-copied from, they must outlive handle_ until zip_close.
+    std::vector<std::shared_ptr<struct zip>> sources_;
+    std::unique_ptr<struct zip, int (*)(struct zip *)> handle_;
+
+    archive(const archive&) = delete;
+    archive& operator=(const archive&) = delete;
+
+    archive(std::string path, std::shared_ptr<const detail::reader> view, flags_t flags)
+        : path_(std::move(path))
+        , view_(std::move(view))
+        , handle_(detail::open(view_, flags), zip_close)
+    {
+    }
+
+    const detail::central_directory& directory() const
+    {
+        if (snapshot_)
+            return snapshot_->directory();
+        std::call_once(*directory_once_, [this] {
+            directory_.reset(new detail::central_directory(*reader()));
+        });
+
+        return *directory_;
+    }
+
+    std::shared_ptr<const detail::reader> reader() const
+    {
+        if (view_)
+            return view_;
+
+        return std::make_shared<detail::file_reader>(path_);
+    }
+
+    int64_t locate(const std::string& name, flags_t flags) const noexcept
+    {
+        if (snapshot_ && flags == 0)
+            return snapshot_->find(name.c_str());
+
+        return zip_name_locate(handle_.get(), name.c_str(), flags | name_flags_);
+    }
+
+    // True if the entries differ from the archive on disk, which other handles read.
+    bool has_changes() const noexcept
+    {
+        const auto count = zip_get_num_entries(handle_.get(), 0);
+
+        if (!pending_.empty() || count != zip_get_num_entries(handle_.get(), ZIP_FL_UNCHANGED))
+            return true;
+
+        for (int64_t i = 0; i < count; ++i)
+            if (changed(i))
+                return true;
+
+        return false;
+    }
+
+    // True if an entry was deleted, renamed or replaced.
+    bool changed(uint64_t index) const noexcept
+    {
+        struct zip_stat now, old;
+
+        if (pending_.count(index) > 0)
+            return true;
+        if (zip_stat_index(handle_.get(), index, ZIP_FL_ENC_RAW, &now) < 0 ||
+            zip_stat_index(handle_.get(), index, ZIP_FL_ENC_RAW | ZIP_FL_UNCHANGED, &old) < 0)
+            return true;
+
+        return std::strcmp(now.name, old.name) != 0 || now.size != old.size || now.crc != old.crc;
+    }
+
+    // True if close has to sort the central directory.
+    bool must_sort() const noexcept
+    {
+#if !defined(_WIN32)
+        if (!sort_directory_ || view_)
+            return false;
+
+        for (int64_t i = 0, n = zip_get_num_entries(handle_.get(), 0); i < n; ++i) {
+            if (zip_get_name(handle_.get(), i, 0) == nullptr)
+                continue;
+            if (has_changes())
+                return true;
+
+            // Unreadable directories are reported by the sort.
+            try {
+                return !directory().sorted();
+            } catch (...) {
+                return true;
+            }
+        }
+#endif
+
+        return false;
+    }
+
+    void modifiable() const
+    {
+        if (snapshot_)
+            throw std::runtime_error("archive is read-only with concurrent reads enabled");
+    }
+
+    executor& scheduler() const
+    {
+        return executor_ ? *executor_ : default_executor();
+    }
+
+    // Archive bytes to read for background work, scheduled if needed.
+    std::shared_ptr<const detail::reader> background(const std::string& path, std::shared_ptr<const detail::reader> view) const
+    {
+        if (!io_)
+            return view;
+        if (!view)
+            view = std::make_shared<detail::file_reader>(path);
+
+        return std::make_shared<detail::scheduled_reader>(std::move(view), io_, io_class::background);
+    }
+
+    file scheduled(file f) const
+    {
+        f.set_io_scheduler(io_);
+
+        return f;
+    }
+
+    void compression_changed(uint64_t index, int32_t comp, uint32_t flags)
+    {
+        auto it = pending_.find(index);
+
+        if (it != pending_.end()) {
+            it->second.method = comp;
+            it->second.level = flags;
+        }
+    }
+
+    template <typename Function>
+    bulk_result apply_if(const entry_predicate& predicate, Function&& fn)
+    {
+        std::vector<uint64_t> selected;
+        std::string name;
+        bulk_result result;
+
+        for (int64_t i = 0, n = zip_get_num_entries(handle_.get(), 0); i < n; ++i) {
+            auto str = zip_get_name(handle_.get(), i, name_flags_);
+
+            // Deleted entries have no name.
+            if (str == nullptr)
+                continue;
+
+            name.assign(str);
+
+            if (predicate(i, name))
+                selected.push_back(i);
+        }
+
+        for (auto index : selected) {
+            if (fn(index) < 0)
+                result.errors.push_back({index, zip_strerror(handle_.get())});
+            else
+                ++ result.applied;
+        }
+
+        return result;
+    }
+
+public:
+    /**
+     * \brief Base iterator class
+     */
+    class iterator : public std::iterator<std::random_access_iterator_tag, libzip::stat> {
+    private:
+        friend class archive;
+
+        archive *archive_{nullptr};
+        uint64_t index_{0};
+
+        inline iterator(archive* archive, uint64_t index = 0) noexcept
+            : archive_(archive)
+            , index_(index)
+        {
+        }
+
+    public:
+        /**
+         * Default iterator.
+         */
+        iterator() noexcept = default;
+
+        /**
+         * Dereference the iterator.
+         *
+         * \return the stat information
+         */
+        inline libzip::stat operator*() const
+        {
+            assert(archive_);
+
+            return archive_->stat(index_);
+        }
+
+        /**
+         * Dereference the iterator.
+         *
+         * \return the stat information as point
+         */
         inline stat_ptr operator->() const
         {
             assert(archive_);
 
-            return stat_ptr(archive_->stat(index_));
-        }
+            return stat_ptr(archive_->stat(index_));
+        }
+
+        /**
+         * Post increment.
+         *
+         * \return this
+         */
+        inline iterator& operator++() noexcept
+        {
+            ++ index_;
+
+            return *this;
+        }
+
+        /**
+         * Pre increment.
+         *
+         * \return this
+         */
+        inline iterator operator++(int) noexcept
+        {
+            iterator save = *this;
+
+            ++ index_;
+
+            return save;
+        }
+
+        /**
+         * Post decrement.
+         *
+         * \return this
+         */
+        inline iterator& operator--() noexcept
+        {
+            -- index_;
+
+            return *this;
+        }
+
+        /**
+         * Pre decrement.
+         *
+         * \return this
+         */
+        inline iterator operator--(int) noexcept
+        {
+            iterator save = *this;
+
+            -- index_;
+
+            return save;
+        }
+
+        /**
+         * Increment.
+         *
+         * \param inc the number
+         * \return the new iterator
+         */
+        inline iterator operator+(int inc) const noexcept
+        {
+            return iterator(archive_, index_ + inc);
+        }
+
+        /**
+         * Decrement.
+         *
+         * \param dec the number
+         * \return the new iterator
+         */
+        inline iterator operator-(int dec) const noexcept
+        {
+            return iterator(archive_, index_ - dec);
+        }
+
+        /**
+         * Compare equality.
+         *
+         * \param other the other iterator
+         * \return true if same
+         */
+        inline bool operator==(const iterator& other) const noexcept
+        {
+            return index_ == other.index_;
+        }
+
+        /**
+         * Compare equality.
+         *
+         * \param other the other iterator
+         * \return true if different
+         */
+        inline bool operator!=(const iterator& other) const noexcept
+        {
+            return index_ != other.index_;
+        }
+
+        /**
+         * Access a stat information at the specified index.
+         *
+         * \pre must not be default-constructed
+         * \param index the new index
+         * \return stat information
+         * \throw std::runtime_error on errors
+         */
+        inline libzip::stat operator[](int index)
+        {
+            assert(archive_);
+
+            return archive_->stat(index_ + index);
+        }
+    };
+
+public:
+    /**
+     * Iterator conversion to Stat.
+     */
+    using value_type = libzip::stat;
+
+    /**
+     * Reference is a copy of Stat.
+     */
+    using reference = libzip::stat;
+
+    /**
+     * Const reference is a copy of Stat.
+     */
+    using const_reference = libzip::stat;
+
+    /**
+     * Pointer is a small wrapper
+     */
+    using pointer = stat_ptr;
+
+    /**
+     * Type of difference.
+     */
+    using size_type = unsigned;
+
+    /**
+     * Const random access iterator.
+     */
+    using const_iterator = iterator;
+
+public:
+    /**
+     * Open an archive on the disk.
+     *
+     * \param path the path
+     * \param flags the optional flags
+     * \throw std::runtime_error on errors
+     */
+    archive(const std::string& path, flags_t flags = 0)
+        : path_(path)
+        , handle_(detail::open(path, flags), zip_close)
+    {
+    }
+
+    /**
+     * Open an archive stored in a range of a larger file, without copying
+     * it out.
+     *
+     * Only the range is visible, offsets in the archive are relative to its
+     * beginning. The archive is read-only.
+     *
+     * \param path the file path
+     * \param range the archive position, see find_embedded
+     * \param flags the optional flags
+     * \throw std::runtime_error on errors
+     */
+    archive(const std::string& path, const byte_range& range, flags_t flags = 0)
+        : archive(path, std::make_shared<detail::window_reader>(std::make_shared<detail::file_reader>(path), range.offset, range.length), flags)
+    {
+    }
+
+    /**
+     * Open a split archive as one archive, without joining the volumes.
+     *
+     * The volumes are the pieces of the archive in order (e.g. .z01, .z02,
+     * ..., .zip) and reads are mapped to them by offset. Operations which
+     * use several handles, like extract, read the volumes in parallel.
+     *
+     * The archive is read-only and the last volume stands for the archive
+     * path where one is needed (e.g. the identity of extraction journals
+     * and caches).
+     *
+     * \pre !volumes.empty()
+     * \param volumes the volume paths in order
+     * \param flags the optional flags
+     * \return the archive
+     * \throw std::runtime_error on errors
+     */
+    static archive open_volumes(const std::vector<std::string>& volumes, flags_t flags = 0)
+    {
+        assert(!volumes.empty());
+
+        return archive(volumes.back(), std::make_shared<detail::volume_reader>(volumes), flags);
+    }
+
+    /**
+     * Move constructor defaulted.
+     *
+     * \param other the other archive
+     */
+    archive(archive&& other) noexcept = default;
+
+    /**
+     * Move operator.
+     *
+     * This archive is closed first, like by the destructor, so it's
+     * written while the archives it copies from are still open.
+     *
+     * \param other the other archive
+     * \return *this
+     */
+    archive& operator=(archive&& other) noexcept
+    {
+        if (this == &other)
+            return *this;
+
+        if (handle_) {
+            try {
+                close();
+            } catch (...) {
+            }
+        }
+
+        handle_ = std::move(other.handle_);
+        sources_ = std::move(other.sources_);
+        path_ = std::move(other.path_);
+        view_ = std::move(other.view_);
+        pins_ = std::move(other.pins_);
+        recorder_ = std::move(other.recorder_);
+        prefetcher_ = std::move(other.prefetcher_);
+        snapshot_ = std::move(other.snapshot_);
+        directory_once_ = std::move(other.directory_once_);
+        directory_ = std::move(other.directory_);
+        name_flags_ = other.name_flags_;
+#if !defined(_WIN32)
+        cache_ = std::move(other.cache_);
+        blobs_ = std::move(other.blobs_);
+        sort_directory_ = other.sort_directory_;
+#endif
+        estimate_ = other.estimate_;
+        executor_ = std::move(other.executor_);
+        io_ = std::move(other.io_);
+        pending_ = std::move(other.pending_);
+
+        return *this;
+    }
+
+    /**
+     * Write the changes and close the archive.
+     */
+    ~archive()
+    {
+        if (!handle_)
+            return;
+
+        // Errors can't be reported from here, see close.
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    /**
+     * Write the changes and close the archive.
+     *
+     * With enable_sorted_directory the central directory is then sorted,
+     * unless the archive is unchanged and already sorted. The archive can
+     * only be destroyed or assigned afterwards.
+     *
+     * \pre the archive must not be closed
+     * \throw std::runtime_error on errors, the changes are then discarded
+     */
+    void close()
+    {
+        assert(handle_);
+
+        const auto sort = must_sort();
+        std::unique_ptr<struct zip, void (*)(struct zip*)> handle(handle_.release(), zip_discard);
+
+#if !defined(_WIN32)
+        if (sort)
+            detail::mark_sorted(handle.get());
+#endif
+
+        if (zip_close(handle.get()) < 0)
+            throw std::runtime_error(zip_strerror(handle.get()));
+
+        handle.release();
+
+#if !defined(_WIN32)
+        if (sort)
+            detail::sort_directory(path_);
+#endif
+    }
+
+    /**
+     * Get an iterator to the beginning.
+     *
+     * \return the iterator
+     */
+    inline iterator begin() noexcept
+    {
+        return iterator(this);
+    }
+
+    /**
+     * Overloaded function.
+     *
+     * \return the iterator
+     */
+    inline const_iterator begin() const noexcept
+    {
+        return const_iterator(const_cast<archive*>(this));
+    }
+
+    /**
+     * Overloaded function.
+     *
+     * \return the iterator
+     */
+    inline const_iterator cbegin() const noexcept
+    {
+        return const_iterator(const_cast<archive*>(this));
+    }
+
+    /**
+     * Get an iterator to the end.
+     *
+     * \return the iterator
+     */
+    inline iterator end() noexcept
+    {
+        return iterator(this, num_entries());
+    }
+
+    /**
+     * Overloaded function.
+     *
+     * \return the iterator
+     */
+    inline const_iterator end() const noexcept
+    {
+        return const_iterator(const_cast<archive*>(this), num_entries());
+    }
+
+    /**
+     * Overloaded function.
+     *
+     * \return the iterator
+     */
+    inline const_iterator cend() const noexcept
+    {
+        return const_iterator(const_cast<archive*>(this), num_entries());
+    }
+
+    /**
+     * Set a comment on a file.
+     *
+     * \param index the file index in the archive
+     * \param text the text or empty to remove the comment
+     * \param flags the optional flags
+     * \throw std::runtime_error on errors
+     */
+    void set_file_comment(uint64_t index, const std::string& text = "", flags_t flags = 0)
+    {
+        modifiable();
+
+        auto size = text.size();
+        auto cstr = (size == 0) ? nullptr : text.c_str();
+
+        if (zip_file_set_comment(handle_.get(), index, cstr, size, flags) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+    }
+
+    /**
+     * Get a comment from a file.
+     *
+     * \param index the file index in the archive
+     * \param flags the optional flags
+     * \return the comment
+     * \throw std::runtime_error on errors
+     */
+    std::string file_comment(uint64_t index, flags_t flags = 0) const
+    {
+        zip_uint32_t length = 0;
+        auto text = zip_file_get_comment(handle_.get(), index, &length, flags);
+
+        if (text == nullptr)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return std::string(text, length);
+    }
+
+    /**
+     * Set an extra field on a file.
+     *
+     * \param index the file index in the archive
+     * \param id the field id
+     * \param data the field data
+     * \param flags where to set it, ZIP_FL_CENTRAL and/or ZIP_FL_LOCAL
+     * \throw std::runtime_error on errors
+     */
+    void set_file_extra_field(uint64_t index, uint16_t id, const std::string& data, flags_t flags = ZIP_FL_CENTRAL | ZIP_FL_LOCAL)
+    {
+        modifiable();
+
+        auto ptr = reinterpret_cast<const uint8_t*>(data.data());
+
+        if (zip_file_extra_field_set(handle_.get(), index, id, ZIP_EXTRA_FIELD_NEW, ptr, data.size(), flags) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+    }
+
+    /**
+     * Get the first extra field with some id from a file.
+     *
+     * \param index the file index in the archive
+     * \param id the field id
+     * \param flags where to look, ZIP_FL_CENTRAL and/or ZIP_FL_LOCAL
+     * \return the field data
+     * \throw std::runtime_error on errors
+     */
+    std::string file_extra_field(uint64_t index, uint16_t id, flags_t flags = ZIP_FL_CENTRAL | ZIP_FL_LOCAL) const
+    {
+        uint16_t length = 0;
+        auto data = zip_file_extra_field_get_by_id(handle_.get(), index, id, 0, &length, flags);
+
+        if (data == nullptr)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return std::string(reinterpret_cast<const char*>(data), length);
+    }
+
+    /**
+     * Set the archive comment.
+     *
+     * \param comment the comment
+     * \throw std::runtime_error on errors
+     */
+    void set_comment(const std::string& comment)
+    {
+        modifiable();
+
+        if (zip_set_archive_comment(handle_.get(), comment.c_str(), comment.size()) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+    }
+
+    /**
+     * Get the archive comment.
+     *
+     * \param flags the optional flags
+     * \return the comment
+     * \throw std::runtime_error on errors
+     */
+    std::string comment(flags_t flags = 0) const
+    {
+        int length = 0;
+        auto text = zip_get_archive_comment(handle_.get(), &length, flags);
+
+        if (text == nullptr)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return std::string(text, static_cast<std::size_t>(length));
+    }
+
+    /**
+     * Check if a file exists on the archive.
+     *
+     * \param name the name
+     * \param flags the optional flags
+     * \return if the file exists
+     */
+    bool exists(const std::string& name, flags_t flags = 0) const noexcept
+    {
+        return locate(name, flags) >= 0;
+    }
+
+    /**
+     * Locate a file on the archive.
+     *
+     * \param name the name
+     * \param flags the optional flags
+     * \return the index
+     * \throw std::runtime_error on errors
+     */
+    int64_t find(const std::string& name, flags_t flags = 0) const
+    {
+        auto index = locate(name, flags);
+
+        if (index < 0 && snapshot_ && flags == 0)
+            throw std::runtime_error("No such file");
+        if (index < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return index;
+    }
+
+    /**
+     * Get the name of a file without copying it.
+     *
+     * \param index the file index in the archive
+     * \param flags the optional flags
+     * \return the name, valid until the entry is modified
+     * \throw std::runtime_error on errors
+     */
+    const char* name(uint64_t index, flags_t flags = 0) const
+    {
+        if (snapshot_ && flags == 0)
+            return snapshot_->at(index).name;
+
+        auto name = zip_get_name(handle_.get(), index, flags | name_flags_);
+
+        if (name == nullptr)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return name;
+    }
+
+    /**
+     * Get information about a file.
+     *
+     * \param name the name
+     * \param flags the optional flags
+     * \return the structure
+     * \throw std::runtime_error on errors
+     */
+    libzip::stat stat(const std::string& name, flags_t flags = 0) const
+    {
+        if (snapshot_ && flags == 0)
+            return snapshot_->at(find(name));
+
+        libzip::stat st;
 
-        /**
-         * Post increment.
-         *
-         * \return this
-         */
-        inline iterator& operator++() noexcept
-        {
-            ++ index_;
+        if (zip_stat(handle_.get(), name.c_str(), flags | name_flags_, &st) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
 
-            return *this;
-        }
+        return st;
+    }
 
-        /**
-         * Pre increment.
-         *
-         * \return this
-         */
-        inline iterator operator++(int) noexcept
-        {
-            iterator save = *this;
+    /**
+     * Get information about a file. Overloaded function.
+     *
+     * \param index the file index in the archive
+     * \param flags the optional flags
+     * \return the structure
+     * \throw std::runtime_error on errors
+     */
+    libzip::stat stat(uint64_t index, flags_t flags = 0) const
+    {
+        if (snapshot_ && flags == 0)
+            return snapshot_->at(index);
 
-            ++ index_;
+        libzip::stat st;
 
-            return save;
-        }
+        if (zip_stat_index(handle_.get(), index, flags | name_flags_, &st) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
 
-        /**
-         * Post decrement.
-         *
-         * \return this
-         */
-        inline iterator& operator--() noexcept
-        {
-            -- index_;
+        return st;
+    }
 
-            return *this;
-        }
+    /**
+     * Add a file to the archive.
+     *
+     * With a blob cache (see enable_blob_cache) the content is read once to
+     * be hashed and the entry is written from the cached compressed data.
+     *
+     * \param source the source
+     * \param name the name entry in the archive
+     * \param flags the optional flags
+     * \return the new index in the archive
+     * \throw std::runtime_error on errors
+     * \see source::file
+     * \see source::buffer
+     */
+    int64_t add(const source& source, const std::string& name, flags_t flags = 0)
+    {
+        modifiable();
 
-        /**
-         * Pre decrement.
-         *
-         * \return this
-         */
-        inline iterator operator--(int) noexcept
-        {
-            iterator save = *this;
+        auto src = source(handle_.get());
 
-            -- index_;
+#if !defined(_WIN32)
+        if (blobs_)
+            src = blobs_->lookup(src);
+#endif
 
-            return save;
-        }
+        auto ret = zip_file_add(handle_.get(), name.c_str(), src, flags);
 
-        /**
-         * Increment.
-         *
-         * \param inc the number
-         * \return the new iterator
-         */
-        inline iterator operator+(int inc) const noexcept
-        {
-            return iterator(archive_, index_ + inc);
+        if (ret < 0) {
+            zip_source_free(src);
+            throw std::runtime_error(zip_strerror(handle_.get()));
         }
 
-        /**
-         * Decrement.
-         *
-         * \param dec the number
-         * \return the new iterator
-         */
-        inline iterator operator-(int dec) const noexcept
-        {
-            return iterator(archive_, index_ - dec);
+        // ZIP_FL_OVERWRITE replaces an existing entry in place.
+        if (pins_)
+            pins_->erase(ret);
+
+        if (estimate_) {
+            zip_source_keep(src);
+            pending_[ret] = {std::shared_ptr<struct zip_source>(src, zip_source_free)};
         }
 
-        /**
-         * Compare equality.
-         *
-         * \param other the other iterator
-         * \return true if same
-         */
-        inline bool operator==(const iterator& other) const noexcept
-        {
-            return index_ == other.index_;
+        return ret;
+    }
+
+    /**
+     * Create a directory in the archive.
+     *
+     * \param directory the directory name
+     * \param flags the optional flags
+     * \return the new index in the archive
+     * \throw std::runtime_error on errors
+     */
+    int64_t mkdir(const std::string& directory, flags_t flags = 0)
+    {
+        modifiable();
+
+        auto ret = zip_dir_add(handle_.get(), directory.c_str(), flags);
+
+        if (ret < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return ret;
+    }
+
+    /**
+     * Replace an existing file in the archive.
+     *
+     * \param source the source
+     * \param index the file index in the archiev
+     * \param flags the optional flags
+     * \throw std::runtime_error on errors
+     */
+    void replace(const source& source, uint64_t index, flags_t flags = 0)
+    {
+        modifiable();
+
+        if (pins_)
+            pins_->erase(index);
+
+        auto src = source(handle_.get());
+
+        if (zip_file_replace(handle_.get(), index, src, flags) < 0) {
+            zip_source_free(src);
+            throw std::runtime_error(zip_strerror(handle_.get()));
         }
 
-        /**
-         * Compare equality.
-         *
-         * \param other the other iterator
-         * \return true if different
-         */
-        inline bool operator!=(const iterator& other) const noexcept
-        {
-            return index_ != other.index_;
+        if (estimate_) {
+            zip_source_keep(src);
+            pending_[index] = {std::shared_ptr<struct zip_source>(src, zip_source_free)};
         }
+    }
 
-        /**
-         * Access a stat information at the specified index.
-         *
-         * \pre must not be default-constructed
-         * \param index the new index
-         * \return stat information
-         * \throw std::runtime_error on errors
-         */
-        inline libzip::stat operator[](int index)
-        {
-            assert(archive_);
+    /**
+     * Open a file in the archive.
+     *
+     * \param name the name
+     * \param flags the optional flags
+     * \param password the optional password
+     * \return the opened file
+     * \throw std::runtime_error on errors
+     */
+    file open(const std::string& name, flags_t flags = 0, const std::string& password = "")
+    {
+        struct zip_file* file;
 
-            return archive_->stat(index_ + index);
+        if (snapshot_ || pins_ || recorder_) {
+            auto index = locate(name, flags);
+
+            if (index >= 0)
+                return open(index, flags, password);
         }
-    };
 
-public:
-    /**
-     * Iterator conversion to Stat.
-     */
-    using value_type = libzip::stat;
+        detail::io_guard guard(io_.get(), io_class::interactive, 0);
+
+        if (password.size() > 0)
+            file = zip_fopen_encrypted(handle_.get(), name.c_str(), flags | name_flags_, password.c_str());
+        else
+            file = zip_fopen(handle_.get(), name.c_str(), flags | name_flags_);
+
+        if (file == nullptr)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return scheduled(file);
+    }
+
+    /**
+     * Open a file in the archive. Overloaded function.
+     *
+     * \param index the file index in the archive
+     * \param flags the optional flags
+     * \param password the optional password
+     * \return the opened file
+     * \throw std::runtime_error on errors
+     */
+    file open(uint64_t index, flags_t flags = 0, const std::string& password = "")
+    {
+        struct zip_file* file;
+
+        if (recorder_)
+            recorder_->record(index);
+
+        if (pins_ && flags == 0 && password.empty())
+            if (auto data = pins_->find(index))
+                return std::unique_ptr<detail::stream>(new detail::memory_stream(std::move(data)));
+
+        detail::io_guard guard(io_.get(), io_class::interactive, 0);
+
+        if (snapshot_ && flags == 0 && password.empty())
+            return scheduled(snapshot_->open(index));
+
+        if (password.size() > 0)
+            file = zip_fopen_index_encrypted(handle_.get(), index, flags, password.c_str());
+        else
+            file = zip_fopen_index(handle_.get(), index, flags);
+
+        if (file == nullptr)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        return scheduled(file);
+    }
+
+    /**
+     * Rename an existing entry in the archive.
+     *
+     * \param index the file index in the archive
+     * \param name the new name
+     * \param flags the optional flags
+     * \throw std::runtime_error on errors
+     */
+    inline void rename(uint64_t index, const std::string& name, flags_t flags = 0)
+    {
+        modifiable();
+
+        if (zip_file_rename(handle_.get(), index, name.c_str(), flags) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+    }
+
+    /**
+     * Set file compression.
+     *
+     * \param index the file index in the archive
+     * \param comp the compression
+     * \param flags the optional flags
+     * \throw std::runtime_error on errors
+     */
+    inline void set_file_compression(uint64_t index, int32_t comp, uint32_t flags = 0)
+    {
+        modifiable();
+
+        if (zip_set_file_compression(handle_.get(), index, comp, flags) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        compression_changed(index, comp, flags);
+    }
 
     /**
-     * Reference is a copy of Stat.
+     * Delete a file from the archive.
+     *
+     * \param index the file index in the archive
+     * \throw std::runtime_error on errors
      */
-    using reference = libzip::stat;
+    inline void remove(uint64_t index)
+    {
+        modifiable();
 
-    /**
-     * Const reference is a copy of Stat.
-     */
-    using const_reference = libzip::stat;
+        if (pins_)
+            pins_->erase(index);
 
-    /**
-     * Pointer is a small wrapper
-     */
-    using pointer = stat_ptr;
+        if (zip_delete(handle_.get(), index) < 0)
+            throw std::runtime_error(zip_strerror(handle_.get()));
+
+        pending_.erase(index);
+    }
 
     /**
-     * Type of difference.
+     * Delete all entries selected by a predicate.
+     *
+     * The names are read once and the predicate is evaluated on all entries
+     * before any change, then the entries are deleted by index without name
+     * lookups. Failures don't stop the operation, they are reported in the
+     * result.
+     *
+     * \param predicate the selection, e.g. glob("*.tmp")
+     * \return the number of deleted entries and the failures
+     * \throw std::runtime_error if the predicate throws
      */
-    using size_type = unsigned;
+    bulk_result remove_if(const entry_predicate& predicate)
+    {
+        modifiable();
+
+        return apply_if(predicate, [this] (uint64_t index) {
+            if (pins_)
+                pins_->erase(index);
+
+            pending_.erase(index);
+
+            return zip_delete(handle_.get(), index);
+        });
+    }
 
     /**
-     * Const random access iterator.
+     * Rename all entries selected by a predicate.
+     *
+     * Entries are renamed in index order, a new name which is still used by
+     * another entry at that point is reported as a failure.
+     *
+     * \param predicate the selection
+     * \param fn the function returning the new name of a selected entry
+     * \param flags the optional flags for zip_file_rename
+     * \return the number of renamed entries and the failures
+     * \throw std::runtime_error if the predicate or fn throws
+     * \see remove_if
      */
-    using const_iterator = iterator;
+    bulk_result rename_if(const entry_predicate& predicate,
+                          const std::function<std::string (uint64_t, const std::string&)>& fn,
+                          flags_t flags = 0)
+    {
+        modifiable();
+
+        std::string name;
+
+        return apply_if(predicate, [&] (uint64_t index) {
+            name = fn(index, zip_get_name(handle_.get(), index, name_flags_));
+
+            return zip_file_rename(handle_.get(), index, name.c_str(), flags);
+        });
+    }
 
-public:
     /**
-     * Open an archive on the disk.
+     * Set the compression of all entries selected by a predicate.
      *
-     * \param path the path
+     * \param predicate the selection
+     * \param comp the compression
      * \param flags the optional flags
-     * \throw std::runtime_error on errors
+     * \return the number of changed entries and the failures
+     * \throw std::runtime_error if the predicate throws
+     * \see remove_if
      */
-    archive(const std::string& path, flags_t flags = 0)
-        : handle_(nullptr, nullptr)
+    bulk_result set_compression_if(const entry_predicate& predicate, int32_t comp, uint32_t flags = 0)
     {
-        int error;
-        struct zip* archive = zip_open(path.c_str(), flags, &error);
-
-        if (archive == nullptr) {
-            char buf[128]{0};
+        modifiable();
 
-            zip_error_to_str(buf, sizeof (buf), error, errno);
+        return apply_if(predicate, [&] (uint64_t index) {
+            auto ret = zip_set_file_compression(handle_.get(), index, comp, flags);
 
-            throw std::runtime_error(buf);
-        }
+            if (ret == 0)
+                compression_changed(index, comp, flags);
 
-        handle_ = { archive, zip_close };
+            return ret;
+        });
     }
 
     /**
-     * Move constructor defaulted.
+     * Merge other archives into this one.
      *
-     * \param other the other archive
+     * The source archives are opened concurrently, and where the system
+     * supports it their files are read ahead in the background, then their
+     * entries are appended in the order of paths and of their index.
+     * Entries are copied as raw compressed data so nothing is recompressed,
+     * but the copy itself is done serially by libzip when the archive is
+     * closed.
+     *
+     * Names keep their bytes and their encoding: names which libzip would
+     * convert from CP437 are added as CP437, the others as UTF-8.
+     *
+     * Directories already present are silently kept whatever the policy.
+     *
+     * \param paths the archives to merge
+     * \param policy what to do with duplicate names
+     * \param concurrency the maximum number of threads, 0 for the executor one
+     * \throw std::runtime_error on errors, the archive may then contain part
+     *        of the entries (see unchange_all)
      */
-    archive(archive&& other) noexcept = default;
+    void merge(const std::vector<std::string>& paths,
+               merge_policy policy = merge_policy::error,
+               unsigned concurrency = 0)
+    {
+        modifiable();
+
+        std::vector<std::shared_ptr<struct zip>> sources(paths.size());
+
+        detail::parallel_for(scheduler(), paths.size(), concurrency, [&] (unsigned, std::size_t i) {
+            sources[i] = std::shared_ptr<struct zip>(detail::open(paths[i], ZIP_RDONLY), zip_discard);
+
+#if defined(POSIX_FADV_WILLNEED)
+            detail::file_reader reader(paths[i]);
+
+            reader.prefetch(0, reader.size());
+#endif
+        });
+
+        for (const auto& src : sources) {
+            sources_.push_back(src);
+
+            for (int64_t i = 0, n = zip_get_num_entries(src.get(), 0); i < n; ++i) {
+                auto name = zip_get_name(src.get(), i, ZIP_FL_ENC_RAW);
+                auto converted = zip_get_name(src.get(), i, 0);
+
+                if (name == nullptr || converted == nullptr)
+                    throw std::runtime_error(zip_strerror(src.get()));
+
+                const auto encoding = std::strcmp(name, converted) == 0 ? ZIP_FL_ENC_UTF_8 : ZIP_FL_ENC_CP437;
+                auto len = std::strlen(name);
+                auto index = zip_name_locate(handle_.get(), name, ZIP_FL_ENC_RAW);
+
+                if (len > 0 && name[len - 1] == '/') {
+                    if (index < 0 && zip_dir_add(handle_.get(), name, encoding) < 0)
+                        throw std::runtime_error(zip_strerror(handle_.get()));
+
+                    continue;
+                }
+
+                if (index >= 0 && policy == merge_policy::keep_first)
+                    continue;
+                if (index >= 0 && policy == merge_policy::error)
+                    throw std::runtime_error(std::string("duplicate entry: ") + converted);
+
+                auto zs = zip_source_zip(handle_.get(), src.get(), i, 0, 0, -1);
+
+                if (zs == nullptr)
+                    throw std::runtime_error(zip_strerror(handle_.get()));
+                if (index >= 0 && pins_)
+                    pins_->erase(index);
+
+                auto ret = index >= 0
+                    ? zip_file_replace(handle_.get(), index, zs, 0)
+                    : zip_file_add(handle_.get(), name, zs, encoding);
+
+                if (ret < 0) {
+                    zip_source_free(zs);
+                    throw std::runtime_error(zip_strerror(handle_.get()));
+                }
+            }
+        }
+    }
 
     /**
-     * Move operator defaulted.
+     * Add the entries of a new archive version rebuilt from the old one and
+     * a patch made with make_patch.
      *
-     * \param other the other archive
-     * \return *this
+     * The patch is read sequentially, unchanged entries are raw-copied from
+     * the old archive and deltas are applied in parallel, each worker
+     * reading the old entries with its own handle and moving the rebuilt
+     * content to an anonymous temporary file. Whole content is read from
+     * the patch when the archive is closed, so the patch must stay in place
+     * until then. The old entries are checked against the CRC recorded in
+     * the patch and the new ones against their new CRC.
+     *
+     * \param from the old archive path
+     * \param patch the patch path
+     * \param concurrency the maximum number of threads, 0 for the executor one
+     * \throw std::runtime_error on errors, the archive may then contain part
+     *        of the entries (see unchange_all)
      */
-    archive& operator=(archive&& other) noexcept = default;
+    void apply_patch(const std::string& from, const std::string& patch, unsigned concurrency = 0)
+    {
+        modifiable();
+
+        std::shared_ptr<struct zip> old(detail::open(from, ZIP_RDONLY), zip_discard);
+        detail::patch_reader reader(patch, zip_get_num_entries(old.get(), 0));
+        std::vector<detail::patch_record> records;
+        std::vector<std::size_t> deltas;
+
+        for (detail::patch_record record; reader.next(record); ) {
+            if (record.op != detail::patch_op::whole) {
+                struct zip_stat st;
+
+                if (zip_stat_index(old.get(), record.index, 0, &st) < 0 || st.crc != record.old_crc)
+                    throw std::runtime_error("patch does not match the archive");
+            }
+            if (record.op == detail::patch_op::delta)
+                deltas.push_back(records.size());
+
+            records.push_back(std::move(record));
+        }
+
+        // Where each rebuilt delta is in the spill file.
+        std::vector<std::pair<uint64_t, uint64_t>> rebuilt(records.size());
+        std::shared_ptr<detail::spill_file> spill;
+
+        if (!deltas.empty())
+            spill = std::make_shared<detail::spill_file>();
+
+        detail::handle_pool pool(from, detail::workers(scheduler(), concurrency, deltas.size()), background(from, nullptr));
+
+        detail::parallel_for(scheduler(), deltas.size(), concurrency, [&] (unsigned slot, std::size_t i) {
+            const auto& record = records[deltas[i]];
+            auto content = detail::head(pool.get(slot), record.index, std::numeric_limits<uint64_t>::max());
+            auto data = detail::apply_delta(content, detail::read_patch_data(patch, record));
+
+            if (::crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size()) != record.crc)
+                throw std::runtime_error("corrupted patch");
+
+            rebuilt[deltas[i]] = {spill->append(data), data.size()};
+        });
+
+        sources_.push_back(old);
+
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            const auto& record = records[i];
+            struct zip_source* zs = nullptr;
+            int64_t index;
+
+            if (!record.name.empty() && record.name.back() == '/')
+                index = zip_dir_add(handle_.get(), record.name.c_str(), ZIP_FL_ENC_UTF_8);
+            else {
+                if (record.op == detail::patch_op::copy)
+                    zs = zip_source_zip(handle_.get(), old.get(), record.index, 0, 0, -1);
+                else if (record.op == detail::patch_op::delta)
+                    zs = detail::make_source(handle_.get(), std::make_shared<detail::window_reader>(spill, rebuilt[i].first, rebuilt[i].second));
+                else
+                    zs = zip_source_file(handle_.get(), patch.c_str(), record.offset, record.size);
+
+                if (zs == nullptr)
+                    throw std::runtime_error(zip_strerror(handle_.get()));
+                if ((index = zip_file_add(handle_.get(), record.name.c_str(), zs, ZIP_FL_ENC_UTF_8)) < 0)
+                    zip_source_free(zs);
+            }
+
+            if (index < 0)
+                throw std::runtime_error(zip_strerror(handle_.get()));
+            if (record.op != detail::patch_op::copy && zip_file_set_mtime(handle_.get(), index, static_cast<std::time_t>(record.mtime), 0) < 0)
+                throw std::runtime_error(zip_strerror(handle_.get()));
+        }
+    }
 
     /**
-     * Get an iterator to the beginning.
+     * Add the entries of another archive, transformed by a function.
      *
-     * \return the iterator
+     * The entries selected by options.filter are processed in batches
+     * bounded by options.max_memory: they are decompressed, given to fn and
+     * compressed again in parallel, then moved to an anonymous temporary
+     * file. Deflated entries are compressed by the workers and written as
+     * they are when this archive is closed, stored entries stay stored and
+     * entries of other methods are compressed by libzip when closing. The
+     * other entries are raw-copied without being decompressed.
+     *
+     * Entries are added in the order of the source archive with their raw
+     * names and encoding, directories are added as is and the modification
+     * times are kept.
+     *
+     * \param from the source archive path
+     * \param fn the transform function
+     * \param options the options
+     * \throw std::runtime_error on errors, including those of fn, the
+     *        archive may then contain part of the entries (see unchange_all)
      */
-    inline iterator begin() noexcept
+    void transform(const std::string& from, const transform_function& fn, const transform_options& options = {})
     {
-        return iterator(this);
+        modifiable();
+
+        std::shared_ptr<struct zip> source(detail::open(from, ZIP_RDONLY), zip_discard);
+        const auto count = static_cast<std::size_t>(zip_get_num_entries(source.get(), 0));
+        std::vector<libzip::stat> stats(count);
+        std::vector<std::size_t> selected;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            if (zip_stat_index(source.get(), i, 0, &stats[i]) < 0)
+                throw std::runtime_error(zip_strerror(source.get()));
+
+            std::string name(stats[i].name);
+
+            if ((name.empty() || name.back() != '/') && (!options.filter || options.filter(stats[i])))
+                selected.push_back(i);
+        }
+
+        // Where each transformed entry is in the spill file, a size of -1 if dropped.
+        struct result {
+            uint64_t offset{0};
+            int64_t length{-1};
+            uint64_t size{0};
+            uLong crc{0};
+        };
+
+        std::vector<result> results(count);
+        std::vector<char> transformed(count);
+        std::shared_ptr<detail::spill_file> spill;
+        detail::handle_pool pool(from, detail::workers(scheduler(), options.concurrency, selected.size()), background(from, nullptr));
+
+        for (auto i : selected)
+            transformed[i] = 1;
+        if (!selected.empty())
+            spill = std::make_shared<detail::spill_file>();
+
+        auto deflated = [&] (std::size_t i) {
+            return !(stats[i].valid & ZIP_STAT_COMP_METHOD) || stats[i].comp_method == ZIP_CM_DEFLATE;
+        };
+
+        for (std::size_t first = 0; first < selected.size(); ) {
+            auto last = first + 1;
+
+            for (auto bytes = stats[selected[first]].size; last < selected.size(); ++last) {
+                if (bytes + stats[selected[last]].size > options.max_memory)
+                    break;
+
+                bytes += stats[selected[last]].size;
+            }
+
+            detail::parallel_for(scheduler(), last - first, options.concurrency, [&] (unsigned slot, std::size_t k) {
+                auto i = selected[first + k];
+                auto content = detail::head(pool.get(slot), i, std::numeric_limits<uint64_t>::max());
+
+                if (!fn(stats[i], content))
+                    return;
+
+                results[i].size = content.size();
+                results[i].crc = detail::checksum(content);
+
+                if (deflated(i))
+                    content = detail::deflate_raw(content, Z_DEFAULT_COMPRESSION);
+
+                results[i].offset = spill->append(content);
+                results[i].length = static_cast<int64_t>(content.size());
+            });
+
+            first = last;
+        }
+
+        sources_.push_back(source);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            const auto name = zip_get_name(source.get(), i, ZIP_FL_ENC_RAW);
+            int64_t index;
+
+            if (transformed[i] && results[i].length < 0)
+                continue;
+            if (name == nullptr)
+                throw std::runtime_error(zip_strerror(source.get()));
+
+            // Names which libzip converts from CP437 keep their bytes.
+            const auto encoding = std::strcmp(name, stats[i].name) == 0 ? ZIP_FL_ENC_UTF_8 : ZIP_FL_ENC_CP437;
+
+            if (!transformed[i] && name[0] != '\0' && name[std::strlen(name) - 1] == '/')
+                index = zip_dir_add(handle_.get(), name, encoding);
+            else {
+                struct zip_source* zs;
+
+                if (!transformed[i])
+                    zs = zip_source_zip(handle_.get(), source.get(), i, 0, 0, -1);
+                else {
+                    auto data = std::make_shared<detail::window_reader>(spill, results[i].offset, results[i].length);
+                    zip_stat_t raw;
+
+                    zip_stat_init(&raw);
+                    raw.valid = ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE | ZIP_STAT_CRC |
+                                ZIP_STAT_COMP_METHOD | ZIP_STAT_ENCRYPTION_METHOD | ZIP_STAT_MTIME;
+                    raw.size = results[i].size;
+                    raw.comp_size = results[i].length;
+                    raw.crc = results[i].crc;
+                    raw.comp_method = ZIP_CM_DEFLATE;
+                    raw.encryption_method = ZIP_EM_NONE;
+                    raw.mtime = stats[i].mtime;
+                    zs = detail::make_source(handle_.get(), std::move(data), deflated(i) ? &raw : nullptr);
+                }
+
+                if (zs == nullptr)
+                    throw std::runtime_error(zip_strerror(handle_.get()));
+                if ((index = zip_file_add(handle_.get(), name, zs, encoding)) < 0)
+                    zip_source_free(zs);
+            }
+
+            if (index < 0)
+                throw std::runtime_error(zip_strerror(handle_.get()));
+            if (!transformed[i])
+                continue;
+            if (!deflated(i) && zip_set_file_compression(handle_.get(), index, stats[i].comp_method, 0) < 0)
+                throw std::runtime_error(zip_strerror(handle_.get()));
+            if (zip_file_set_mtime(handle_.get(), index, stats[i].mtime, 0) < 0)
+                throw std::runtime_error(zip_strerror(handle_.get()));
+        }
     }
 
     /**
-     * Overloaded function.
+     * Find the entries which contain some bytes.
      *
-     * \return the iterator
+     * Entries are decompressed in parallel and scanned as their content is
+     * read, they are never stored entirely in memory. When the archive has
+     * pending changes, entries are scanned one after the other with this
+     * handle instead, deleted entries are skipped and added or replaced
+     * ones can't be read.
+     *
+     * \param needle the bytes to look for
+     * \param first_only report only the first match of each entry
+     * \param concurrency the maximum number of threads, 0 for the executor one
+     * \return the matches sorted by index then offset
+     * \throw std::runtime_error on errors
      */
-    inline const_iterator begin() const noexcept
+    std::vector<search_hit> search(const std::string& needle, bool first_only = false, unsigned concurrency = 0) const
     {
-        return const_iterator(const_cast<archive*>(this));
+        if (needle.empty())
+            throw std::runtime_error("empty search pattern");
+
+        auto count = static_cast<std::size_t>(num_entries());
+        std::vector<std::vector<uint64_t>> offsets(count);
+
+        if (has_changes()) {
+            for (std::size_t i = 0; i < count; ++i)
+                if (zip_get_name(handle_.get(), i, 0) != nullptr)
+                    offsets[i] = detail::find_all(handle_.get(), i, needle, first_only);
+        } else {
+            detail::handle_pool pool(path_, detail::workers(scheduler(), concurrency, count), background(path_, view_));
+
+            detail::parallel_for(scheduler(), count, concurrency, [&] (unsigned slot, std::size_t i) {
+                offsets[i] = detail::find_all(pool.get(slot), i, needle, first_only);
+            });
+        }
+
+        std::vector<search_hit> hits;
+
+        for (std::size_t i = 0; i < count; ++i)
+            for (auto offset : offsets[i])
+                hits.push_back({i, offset});
+
+        return hits;
     }
 
     /**
-     * Overloaded function.
+     * Read the first bytes of many entries, e.g. to sniff their type.
      *
-     * \return the iterator
+     * Entries are visited by increasing index, which is usually the order of
+     * their data in the file, so the disk is read forward. They are read in
+     * parallel from the archive as stored on disk, or with this handle when
+     * only one thread is used or the archive has pending changes, so both
+     * ways see the same entries.
+     *
+     * \param indices the entries
+     * \param length the maximum number of bytes per entry
+     * \param concurrency the maximum number of threads, 0 for the executor one
+     * \return the bytes, in the same order as indices
+     * \throw std::runtime_error on errors
      */
-    inline const_iterator cbegin() const noexcept
+    std::vector<std::string> peek(const std::vector<uint64_t>& indices, uint64_t length, unsigned concurrency = 0) const
     {
-        return const_iterator(const_cast<archive*>(this));
+        std::vector<std::size_t> order(indices.size());
+        std::vector<std::string> result(indices.size());
+
+        for (std::size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+
+        std::sort(order.begin(), order.end(), [&] (auto lhs, auto rhs) {
+            return indices[lhs] < indices[rhs];
+        });
+
+        if (has_changes() || (detail::workers(scheduler(), concurrency, order.size()) == 1 && !io_)) {
+            for (auto i : order)
+                result[i] = detail::head(handle_.get(), indices[i], length);
+        } else {
+            detail::handle_pool pool(path_, detail::workers(scheduler(), concurrency, order.size()), background(path_, view_));
+
+            detail::parallel_for(scheduler(), order.size(), concurrency, [&] (unsigned slot, std::size_t i) {
+                result[order[i]] = detail::head(pool.get(slot), indices[order[i]], length);
+            });
+        }
+
+        return result;
     }
 
     /**
-     * Get an iterator to the end.
+     * Start loading some entries in memory in the background.
      *
-     * \return the iterator
+     * A thread opens the archive as stored on disk, selects the entries
+     * matching the policy and keeps their uncompressed content in memory,
+     * skipping those which no longer fit in the budget. Later calls to open with no flags nor
+     * password are then served from memory without any I/O. Replacing or
+     * removing an entry drops it from memory.
+     *
+     * Calling it again discards the previous preload.
+     *
+     * \param policy the entries to load
      */
-    inline iterator end() noexcept
+    void preload(preload_policy policy)
     {
-        return iterator(this, num_entries());
+        pins_.reset();
+        pins_.reset(new detail::pin_store(path_, background(path_, view_), std::move(policy)));
     }
 
     /**
-     * Overloaded function.
+     * Get the progress and memory usage of preload.
      *
-     * \return the iterator
+     * \return the status, empty if preload was not called
      */
-    inline const_iterator end() const noexcept
+    libzip::preload_status preload_status() const
     {
-        return const_iterator(const_cast<archive*>(this), num_entries());
+        return pins_ ? pins_->status() : libzip::preload_status();
     }
 
     /**
-     * Overloaded function.
-     *
-     * \return the iterator
+     * Wait until preload is finished.
      */
-    inline const_iterator cend() const noexcept
+    void wait_preload()
     {
-        return const_iterator(const_cast<archive*>(this), num_entries());
+        if (pins_)
+            pins_->wait();
     }
 
     /**
-     * Set a comment on a file.
+     * Start recording the indices of the entries opened with open.
      *
-     * \param index the file index in the archive
-     * \param text the text or empty to remove the comment
-     * \param flags the optional flags
+     * The trace can be read back with read_trace and replayed with
+     * prefetch or preload_policy::indices. Calling it again starts a new
+     * trace.
+     *
+     * \param path the trace path
      * \throw std::runtime_error on errors
      */
-    void set_file_comment(uint64_t index, const std::string& text = "", flags_t flags = 0)
+    void record(const std::string& path)
     {
-        auto size = text.size();
-        auto cstr = (size == 0) ? nullptr : text.c_str();
+        recorder_.reset();
+        recorder_.reset(new detail::trace_recorder(path));
+    }
 
-        if (zip_file_set_comment(handle_.get(), index, cstr, size, flags) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+    /**
+     * Stop recording and close the trace.
+     */
+    void stop_recording() noexcept
+    {
+        recorder_.reset();
     }
 
     /**
-     * Get a comment from a file.
+     * Warm the system cache with the entries of a recorded trace.
      *
-     * \param index the file index in the archive
-     * \param flags the optional flags
-     * \return the comment
-     * \throw std::runtime_error on errors
+     * A background thread reads the central directory, sorts the entries
+     * by position in the file, merges neighbour ranges and issues readahead
+     * for them (posix_fadvise where available). Errors are ignored as it is
+     * only a hint.
+     *
+     * \param trace the trace path
+     * \throw std::runtime_error if the trace can't be read
      */
-    std::string file_comment(uint64_t index, flags_t flags = 0) const
+    void prefetch(const std::string& trace)
     {
-        zip_uint32_t length = 0;
-        auto text = zip_file_get_comment(handle_.get(), index, &length, flags);
+        auto indices = read_trace(trace);
 
-        if (text == nullptr)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        prefetcher_.reset();
+        prefetcher_.reset(new detail::prefetcher(background(path_, reader()), std::move(indices)));
+    }
 
-        return std::string(text, length);
+    /**
+     * Wait until the readahead of prefetch is issued.
+     */
+    void wait_prefetch()
+    {
+        if (prefetcher_)
+            prefetcher_->wait();
     }
 
     /**
-     * Set the archive comment.
+     * Get the progress of prefetch.
      *
-     * \param comment the comment
-     * \throw std::runtime_error on errors
+     * \return the status, empty if prefetch was not called
      */
-    void set_comment(const std::string& comment)
+    libzip::prefetch_status prefetch_status() const
     {
-        if (zip_set_archive_comment(handle_.get(), comment.c_str(), comment.size()) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        return prefetcher_ ? prefetcher_->status() : libzip::prefetch_status();
     }
 
     /**
-     * Get the archive comment.
+     * Get an extra field of every entry in one pass.
      *
-     * \param flags the optional flags
-     * \return the comment
+     * The fields are read from the central directory of the archive as
+     * stored on disk, which is loaded once and kept. The data points into
+     * it and stays valid as long as the archive.
+     *
+     * \param id the field id
+     * \return the fields, sorted by index
      * \throw std::runtime_error on errors
      */
-    std::string comment(flags_t flags = 0) const
+    std::vector<extra_field> extra_fields(uint16_t id) const
     {
-        int length = 0;
-        auto text = zip_get_archive_comment(handle_.get(), &length, flags);
-
-        if (text == nullptr)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        const auto& cd = directory();
+        std::vector<extra_field> result;
+
+        for (std::size_t i = 0; i < cd.entries().size(); ++i) {
+            cd.for_each_extra(cd.entries()[i], [&] (auto field, auto data, auto size) {
+                if (field == id)
+                    result.push_back({i, data, size});
+            });
+        }
 
-        return std::string(text, static_cast<std::size_t>(length));
+        return result;
     }
 
     /**
-     * Check if a file exists on the archive.
+     * Decode the extended timestamp fields (0x5455) of every entry.
      *
-     * \param name the name
-     * \param flags the optional flags
-     * \return if the file exists
+     * \return the table
+     * \throw std::runtime_error on errors
      */
-    bool exists(const std::string& name, flags_t flags = 0) const noexcept
+    timestamp_table timestamps() const
     {
-        return zip_name_locate(handle_.get(), name.c_str(), flags) >= 0;
+        timestamp_table table;
+
+        for (const auto& field : extra_fields(0x5455)) {
+            if (field.size < 1)
+                continue;
+
+            int64_t times[3] = {-1, -1, -1};
+            std::size_t pos = 1;
+
+            for (int bit = 0; bit < 3; ++bit) {
+                if ((field.data[0] & (1 << bit)) && pos + 4 <= field.size) {
+                    times[bit] = static_cast<int32_t>(detail::le32(field.data + pos));
+                    pos += 4;
+                }
+            }
+
+            table.index.push_back(field.index);
+            table.mtime.push_back(times[0]);
+            table.atime.push_back(times[1]);
+            table.ctime.push_back(times[2]);
+        }
+
+        return table;
     }
 
     /**
-     * Locate a file on the archive.
+     * Decode the Info-ZIP Unix owner fields (0x7875) of every entry.
      *
-     * \param name the name
-     * \param flags the optional flags
-     * \return the index
+     * \return the table
      * \throw std::runtime_error on errors
      */
-    int64_t find(const std::string& name, flags_t flags = 0) const
+    owner_table owners() const
     {
-        auto index = zip_name_locate(handle_.get(), name.c_str(), flags);
+        owner_table table;
 
-        if (index < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        for (const auto& field : extra_fields(0x7875)) {
+            // version (1), uid size (1), uid, gid size (1), gid
+            auto decode = [&] (std::size_t& pos, uint64_t& value) {
+                if (pos >= field.size || field.data[pos] > 8 || pos + 1 + field.data[pos] > field.size)
+                    return false;
 
-        return index;
+                value = 0;
+
+                for (std::size_t i = field.data[pos]; i-- > 0; )
+                    value = (value << 8) | field.data[pos + 1 + i];
+
+                pos += 1 + field.data[pos];
+
+                return true;
+            };
+
+            std::size_t pos = 1;
+            uint64_t uid, gid;
+
+            if (field.size < 1 || field.data[0] != 1 || !decode(pos, uid) || !decode(pos, gid))
+                continue;
+
+            table.index.push_back(field.index);
+            table.uid.push_back(uid);
+            table.gid.push_back(gid);
+        }
+
+        return table;
     }
 
+#if !defined(_WIN32)
     /**
-     * Get information about a file.
+     * Extract all entries to a directory.
      *
-     * \param name the name
-     * \param flags the optional flags
-     * \return the structure
+     * Entries are extracted in parallel from the archive as stored on disk,
+     * each worker using its own handle. When the archive has pending
+     * changes, they are extracted one after the other with this handle
+     * instead, deleted entries are skipped and added or replaced ones can't
+     * be read. The files get the modification time
+     * of their entry, which lets a later incremental extraction skip them
+     * with a single stat. Names which are absolute or contain a '..'
+     * component are rejected.
+     *
+     * Only available on POSIX systems.
+     *
+     * \param directory the destination, created if needed
+     * \param options the options
+     * \return the number of files extracted and skipped, and the bytes
      * \throw std::runtime_error on errors
      */
-    libzip::stat stat(const std::string& name, flags_t flags = 0) const
+    extract_result extract(const std::string& directory, const extract_options& options = {}) const
     {
-        libzip::stat st;
+        const auto count = static_cast<std::size_t>(num_entries());
+        const auto serial = has_changes();
+        detail::handle_pool pool(path_, serial ? 0 : detail::workers(scheduler(), options.concurrency, count), background(path_, view_));
+        std::atomic<uint64_t> extracted{0}, skipped{0}, logical{0}, written{0};
+        std::unique_ptr<detail::journal> log;
+
+        detail::make_directories(directory);
+
+        if (options.journal) {
+            auto path = directory;
+
+            while (path.size() > 1 && path.back() == '/')
+                path.pop_back();
+
+            log.reset(new detail::journal(path + ".journal", path_, count));
+        }
+
+        auto each = [&] (struct zip* handle, std::size_t i) {
+            libzip::stat st;
+
+            if (zip_stat_index(handle, i, 0, &st) < 0)
+                throw std::runtime_error(zip_strerror(handle));
+
+            std::string name(st.name);
+
+            detail::check_name(name);
+
+            auto path = directory + "/" + name;
+
+            if (name.back() == '/') {
+                detail::make_directories(path);
+                return;
+            }
+
+            detail::make_directories(path.substr(0, path.rfind('/')));
+
+            auto done = log && log->completed[i];
+
+            if ((options.incremental || done) && detail::up_to_date(path, st)) {
+                ++ skipped;
+                return;
+            }
+
+            uint64_t resume = 0;
+
+            if (log && log->partial.count(i) > 0)
+                resume = log->partial.at(i);
+
+            auto bytes = detail::extract_entry(handle, st, path, resume, log.get(), io_.get(), options.sparse);
+
+            ++ extracted;
+            logical += bytes.logical;
+            written += bytes.written;
+
+            if (log)
+                log->complete(i);
+        };
 
-        if (zip_stat(handle_.get(), name.c_str(), flags, &st) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        if (serial) {
+            for (std::size_t i = 0; i < count; ++i)
+                if (zip_get_name(handle_.get(), i, 0) != nullptr)
+                    each(handle_.get(), i);
+        } else {
+            detail::parallel_for(scheduler(), count, options.concurrency, [&] (unsigned slot, std::size_t i) {
+                each(pool.get(slot), i);
+            });
+        }
 
-        return st;
+        if (log)
+            log->finish();
+
+        return {extracted, skipped, logical, written};
     }
 
     /**
-     * Get information about a file. Overloaded function.
+     * Keep extracted entries in a cache directory shared by processes.
      *
-     * \param index the file index in the archive
-     * \param flags the optional flags
-     * \return the structure
+     * Only available on POSIX systems.
+     *
+     * \param directory the cache directory, created if needed
+     * \param max_size the maximum total size of the cache, the least
+     *        recently used files are removed above it, 0 for no limit
      * \throw std::runtime_error on errors
+     * \see materialize
      */
-    libzip::stat stat(uint64_t index, flags_t flags = 0) const
+    void enable_cache(const std::string& directory, uint64_t max_size = 0)
     {
-        libzip::stat st;
-
-        if (zip_stat_index(handle_.get(), index, flags, &st) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
-
-        return st;
+        cache_.reset(new detail::extraction_cache(directory, path_, max_size));
     }
 
     /**
-     * Add a file to the archive.
+     * Reuse compressed data across archives and processes.
      *
-     * \param source the source
-     * \param name the name entry in the archive
-     * \param flags the optional flags
-     * \return the new index in the archive
+     * Files added with add are hashed and looked up in the cache directory
+     * by content, size, CRC and level. On a hit the cached deflate data is
+     * written as is, so the same content is never compressed twice, even
+     * by different builds. On a miss it's compressed once into the cache.
+     *
+     * Cached data is read when the archive is closed, max_size must leave
+     * room for all the entries of the archives being written at once.
+     * Changing the compression of such an entry recompresses it. Only
+     * available on POSIX systems.
+     *
+     * \param directory the cache directory, created if needed
+     * \param max_size the maximum total size of the cache, the least
+     *        recently used blobs are removed above it, 0 for no limit
+     * \param level the zlib compression level
      * \throw std::runtime_error on errors
-     * \see source::file
-     * \see source::buffer
      */
-    int64_t add(const source& source, const std::string& name, flags_t flags = 0)
+    void enable_blob_cache(const std::string& directory, uint64_t max_size = 0, int level = Z_DEFAULT_COMPRESSION)
     {
-        auto src = source(handle_.get());
-        auto ret = zip_file_add(handle_.get(), name.c_str(), src, flags);
-
-        if (ret < 0) {
-            zip_source_free(src);
-            throw std::runtime_error(zip_strerror(handle_.get()));
-        }
-
-        return ret;
+        blobs_.reset(new detail::blob_cache(directory, max_size, level));
     }
 
     /**
-     * Create a directory in the archive.
+     * Get an entry as a file on the disk.
      *
-     * \param directory the directory name
-     * \param flags the optional flags
-     * \return the new index in the archive
+     * The entry is extracted once into the cache directory and later calls,
+     * from this process or others, return the same file as long as the
+     * archive on the disk is unchanged. Concurrent calls for the same entry
+     * wait for a single extraction. The file is read-only and executable
+     * if the entry has a UNIX executable mode.
+     *
+     * Files may be evicted by later calls when the cache is full, open
+     * them or copy them if they must be kept. The entry must not have
+     * pending changes. Only available on POSIX systems.
+     *
+     * \pre enable_cache must have been called
+     * \param index the entry index
+     * \return the path to the file
      * \throw std::runtime_error on errors
      */
-    int64_t mkdir(const std::string& directory, flags_t flags = 0)
+    std::string materialize(uint64_t index) const
     {
-        auto ret = zip_dir_add(handle_.get(), directory.c_str(), flags);
-
-        if (ret < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        assert(cache_);
 
-        return ret;
+        return cache_->materialize(handle_.get(), stat(index));
     }
 
+#if defined(__linux__)
     /**
-     * Replace an existing file in the archive.
+     * Extract an entry to an anonymous memory file (memfd).
      *
-     * \param source the source
-     * \param index the file index in the archiev
-     * \param flags the optional flags
+     * The file is sealed against writes, resizes and further seals, so it
+     * can be loaded with dlopen("/proc/self/fd/N") or run with fexecve
+     * without any temporary file to clean up. Unencrypted stored entries of
+     * an archive opened from a path are copied from the archive file inside
+     * the kernel, other entries are decompressed. The content is checked
+     * against the CRC-32 of the entry either way.
+     *
+     * Only available on Linux.
+     *
+     * \param index the entry index
+     * \return the descriptor at offset 0, the caller closes it
      * \throw std::runtime_error on errors
      */
-    void replace(const source& source, uint64_t index, flags_t flags = 0)
+    int to_memfd(uint64_t index) const
     {
-        auto src = source(handle_.get());
+        auto st = stat(index);
+        auto name = std::string(st.name);
 
-        if (zip_file_replace(handle_.get(), index, src, flags) < 0) {
-            zip_source_free(src);
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        name = name.substr(name.rfind('/') + 1).substr(0, 200);
+
+        detail::output_file out(::memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING));
+
+        if (out.fd() < 0)
+            throw std::runtime_error(std::strerror(errno));
+
+        auto direct = !view_ && !changed(index) &&
+            st.comp_method == ZIP_CM_STORE && st.encryption_method == ZIP_EM_NONE &&
+            index < directory().entries().size();
+
+        if (direct) {
+            const auto& entry = directory().entries()[index];
+
+            direct = entry.method == ZIP_CM_STORE && entry.crc == st.crc && entry.comp_size == st.size;
+        }
+
+        if (direct) {
+            detail::file_reader file(path_);
+
+            detail::copy_range(file.fd(), directory().data_offset(file, directory().entries()[index]), out, st.size);
+
+            uLong crc = ::crc32(0, nullptr, 0);
+
+            if (st.size > 0) {
+                auto map = ::mmap(nullptr, st.size, PROT_READ, MAP_SHARED, out.fd(), 0);
+
+                if (map == MAP_FAILED)
+                    throw std::runtime_error(std::strerror(errno));
+
+                auto data = static_cast<const Bytef*>(map);
+
+                for (uint64_t pos = 0; pos < st.size; pos += 1U << 30)
+                    crc = ::crc32(crc, data + pos, static_cast<uInt>(std::min<uint64_t>(st.size - pos, 1U << 30)));
+
+                ::munmap(map, st.size);
+            }
+
+            if (crc != st.crc)
+                throw std::runtime_error("CRC error");
+        } else {
+            std::unique_ptr<struct zip_file, int (*)(struct zip_file*)> file(zip_fopen_index(handle_.get(), index, 0), zip_fclose);
+            std::vector<char> buffer(65536);
+
+            if (!file)
+                throw std::runtime_error(zip_strerror(handle_.get()));
+
+            for (zip_int64_t count; (count = zip_fread(file.get(), buffer.data(), buffer.size())) != 0; ) {
+                if (count < 0)
+                    throw std::runtime_error(zip_file_strerror(file.get()));
+
+                out.write(buffer.data(), count);
+            }
         }
+
+        if (::fcntl(out.fd(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+            ::lseek(out.fd(), 0, SEEK_SET) < 0)
+            throw std::runtime_error(std::strerror(errno));
+
+        return out.release();
     }
+#endif
+#endif
 
     /**
-     * Open a file in the archive.
+     * Treat all names as UTF-8 without any conversion.
      *
-     * \param name the name
-     * \param flags the optional flags
-     * \param password the optional password
-     * \return the opened file
+     * Every name is validated once, then stat, find, exists, name, open and
+     * the iterators ask libzip for the raw names (ZIP_FL_ENC_RAW) instead of
+     * guessing their encoding and converting CP437 ones on each call.
+     *
+     * \return the indices of the names which are not valid UTF-8, they are
+     *         still served raw
      * \throw std::runtime_error on errors
      */
-    file open(const std::string& name, flags_t flags = 0, const std::string& password = "")
+    std::vector<uint64_t> enable_strict_utf8()
     {
-        struct zip_file* file;
+        std::vector<uint64_t> invalid;
 
-        if (password.size() > 0)
-            file = zip_fopen_encrypted(handle_.get(), name.c_str(), flags, password.c_str());
-        else
-            file = zip_fopen(handle_.get(), name.c_str(), flags);
+        name_flags_ = ZIP_FL_ENC_RAW;
 
-        if (file == nullptr)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        for (int64_t i = 0, n = zip_get_num_entries(handle_.get(), 0); i < n; ++i) {
+            auto str = zip_get_name(handle_.get(), i, ZIP_FL_ENC_RAW);
 
-        return file;
+            // Deleted entries have no name.
+            if (str != nullptr && !detail::valid_utf8(str, std::strlen(str)))
+                invalid.push_back(i);
+        }
+
+        return invalid;
     }
 
     /**
-     * Open a file in the archive. Overloaded function.
+     * Run the parallel operations of this archive (merge, transform,
+     * search, peek, extract...) on an executor instead of the default
+     * thread pool. Their concurrency parameters still cap the number of
+     * threads used by each call.
      *
-     * \param index the file index in the archive
-     * \param flags the optional flags
-     * \param password the optional password
-     * \return the opened file
-     * \throw std::runtime_error on errors
+     * \param ex the executor, null for the default one
+     * \see default_executor
      */
-    file open(uint64_t index, flags_t flags = 0, const std::string& password = "")
+    void set_executor(std::shared_ptr<executor> ex) noexcept
     {
-        struct zip_file* file;
-
-        if (password.size() > 0)
-            file = zip_fopen_index_encrypted(handle_.get(), index, flags, password.c_str());
-        else
-            file = zip_fopen_index(handle_.get(), index, flags);
-
-        if (file == nullptr)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        executor_ = std::move(ex);
+    }
 
-        return file;
+    /**
+     * Schedule the I/O of this archive.
+     *
+     * The files returned by open are read as interactive I/O. The archive
+     * reads of extract, search, peek, transform, apply_patch, preload and
+     * prefetch and the file writes of extract are background I/O. Writes
+     * made by libzip when the archive is closed are not scheduled.
+     *
+     * Files opened before the call are not affected.
+     *
+     * \param io the scheduler, null for none
+     */
+    void set_io_scheduler(std::shared_ptr<io_scheduler> io) noexcept
+    {
+        io_ = std::move(io);
     }
 
     /**
-     * Rename an existing entry in the archive.
+     * Allow several threads to read this archive at the same time.
+     *
+     * The central directory is read once into an immutable snapshot, then
+     * num_entries, stat, find, exists and open with no flags are served
+     * from it without locks and without libzip. Each opened file reads the
+     * archive with positional reads on a shared descriptor and inflates the
+     * data itself, so threads reading different entries don't wait for
+     * each other.
+     *
+     * Only stored and deflated entries without encryption can be opened
+     * this way. Names are the raw bytes of the archive, no encoding
+     * conversion is done. The archive can't be modified afterwards, add,
+     * replace, remove, rename and the other changes then throw.
      *
-     * \param index the file index in the archive
-     * \param name the new name
-     * \param flags the optional flags
      * \throw std::runtime_error on errors
      */
-    inline void rename(uint64_t index, const std::string& name, flags_t flags = 0)
+    void enable_concurrent_reads()
     {
-        if (zip_file_rename(handle_.get(), index, name.c_str(), flags) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        snapshot_.reset(new detail::snapshot(reader()));
     }
 
     /**
-     * Set file compression.
+     * Keep the sources given to add and replace from now on until the
+     * archive is written, so that estimate can sample them.
      *
-     * \param index the file index in the archive
-     * \param comp the compression
-     * \param flags the optional flags
-     * \throw std::runtime_error on errors
+     * \see estimate
      */
-    inline void set_file_compression(uint64_t index, int32_t comp, uint32_t flags = 0)
+    void enable_estimate() noexcept
     {
-        if (zip_set_file_compression(handle_.get(), index, comp, flags) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        estimate_ = true;
     }
 
+#if !defined(_WIN32)
     /**
-     * Delete a file from the archive.
+     * Write the central directory sorted by name when the archive is
+     * destroyed.
      *
-     * \param index the file index in the archive
-     * \throw std::runtime_error on errors
+     * Names are compared bytewise (which is code point order for UTF-8)
+     * and the first record gets an extra field marking the order, the
+     * number of entries and a CRC-32 of the names. enable_concurrent_reads
+     * then finds entries by binary search over the records, without
+     * building any index. Other readers see a regular archive, its indices
+     * follow the new order.
+     *
+     * The archive must have been opened from a path. Call close to get
+     * the errors of the final write, the destructor ignores them and
+     * readers then see an unsorted directory.
+     *
+     * Only available on POSIX systems.
      */
-    inline void remove(uint64_t index)
+    void enable_sorted_directory() noexcept
     {
-        if (zip_delete(handle_.get(), index) < 0)
-            throw std::runtime_error(zip_strerror(handle_.get()));
+        sort_directory_ = true;
     }
+#endif
 
     /**
      * Get the number of entries in the archive.
@@ -899,9 +7582,168 @@ public:
      */
     inline int64_t num_entries(flags_t flags = 0) const noexcept
     {
+        if (snapshot_ && flags == 0)
+            return snapshot_->size();
+
         return zip_get_num_entries(handle_.get(), flags);
     }
 
+    /**
+     * Predict the size of the archive and the compression time of its
+     * closing, without writing it.
+     *
+     * Unchanged and raw-copied entries are counted exactly. The seekable
+     * sources added with add and replace since enable_estimate which will
+     * be compressed are sampled with
+     * blocks of 64 KiB spread over their content, about 1% of their bytes
+     * but at least 4 MiB, and each block is deflated on its own at the
+     * entry level. The size and time are extrapolated from the blocks with
+     * their 95% confidence intervals. The time is the CPU time of the
+     * compression of the blocks, so it's not inflated by a busy machine.
+     *
+     * Compressing blocks separately slightly overestimates the size, other
+     * methods than deflate are estimated as deflate and the I/O time is
+     * not included. Other changed entries can't be sampled, they are
+     * counted as stored and reported in unknown.
+     *
+     * \return the estimate
+     * \throw std::runtime_error on errors
+     */
+    estimate_result estimate() const
+    {
+        constexpr uint64_t block = 65536;
+
+        struct item {
+            struct zip_source* source;
+            uint64_t size;
+            int level;
+        };
+
+        std::vector<item> items;
+        std::vector<uint64_t> starts;
+        estimate_result result;
+        uint64_t exact = 22, total = 0;
+
+        for (int64_t i = 0, n = zip_get_num_entries(handle_.get(), 0); i < n; ++i) {
+            libzip::stat st;
+
+            // Deleted entries.
+            if (zip_stat_index(handle_.get(), i, 0, &st) < 0)
+                continue;
+
+            // Local and central headers.
+            exact += 30 + 46 + 2 * std::strlen(st.name);
+
+            auto it = pending_.find(i);
+
+            if (it == pending_.end()) {
+                if (changed(i)) {
+                    auto size = (st.valid & ZIP_STAT_SIZE) ? st.size : 0;
+
+                    exact += size;
+                    result.unknown += size;
+                } else
+                    exact += (st.valid & ZIP_STAT_COMP_SIZE) ? st.comp_size : st.size;
+
+                continue;
+            }
+
+            libzip::stat sst;
+
+            zip_stat_init(&sst);
+            zip_source_stat(it->second.source.get(), &sst);
+
+            const auto raw = (sst.valid & ZIP_STAT_COMP_METHOD) && (sst.valid & ZIP_STAT_COMP_SIZE) &&
+                             sst.comp_method != ZIP_CM_STORE && it->second.method == ZIP_CM_DEFAULT;
+            const auto size = (sst.valid & ZIP_STAT_SIZE) ? sst.size : st.size;
+
+            if (raw)
+                exact += sst.comp_size;
+            else if (it->second.method == ZIP_CM_STORE)
+                exact += size;
+            else if (!detail::seekable(it->second.source.get())) {
+                exact += size;
+                result.unknown += size;
+            } else if (size > 0) {
+                auto level = it->second.level == 0 ? Z_DEFAULT_COMPRESSION : static_cast<int>(it->second.level);
+
+                items.push_back({it->second.source.get(), size, level});
+                starts.push_back(total);
+                total += size;
+            }
+        }
+
+        double size = exact, size_error = 0, cpu = 0, cpu_error = 0;
+
+        if (total > 0) {
+            const auto budget = std::max<uint64_t>(4U << 20, total / 100);
+            const auto count = std::max<uint64_t>(1, std::min((total + block - 1) / block, budget / block));
+            const auto stride = static_cast<double>(total) / count;
+            std::minstd_rand random(42);
+            std::vector<double> ratios, costs;
+
+            // Systematic sampling, one block at a random place of each stride.
+            for (uint64_t k = 0; k < count; ++k) {
+                auto room = std::max(stride - block, 0.0);
+                auto position = static_cast<uint64_t>(k * stride + room * random() / random.max());
+
+                position = std::min(position, total - 1);
+
+                auto i = std::upper_bound(starts.begin(), starts.end(), position) - starts.begin() - 1;
+                auto offset = position - starts[i];
+                auto data = detail::read_source(items[i].source, offset, std::min(block, items[i].size - offset));
+
+                if (data.empty())
+                    continue;
+
+                auto begin = detail::cpu_time();
+                auto compressed = detail::deflated_size(data, items[i].level);
+                auto elapsed = detail::cpu_time() - begin;
+
+                ratios.push_back(static_cast<double>(compressed) / data.size());
+                costs.push_back(elapsed / data.size());
+                result.sampled += data.size();
+            }
+
+            auto extrapolate = [&] (const std::vector<double>& values, double fallback, double& mean, double& error) {
+                double sum = 0, squares = 0;
+
+                for (auto v : values)
+                    sum += v;
+
+                mean = values.empty() ? fallback : sum / values.size();
+
+                for (auto v : values)
+                    squares += (v - mean) * (v - mean);
+
+                // Standard error with the finite population correction.
+                auto n = static_cast<double>(values.size());
+                auto fraction = std::min(1.0, static_cast<double>(result.sampled) / total);
+                auto variance = n > 1 ? squares / (n - 1) : 0;
+
+                error = 1.96 * std::sqrt(variance / std::max(n, 1.0) * (1 - fraction)) * total;
+                mean *= total;
+            };
+
+            double ratio, cost;
+
+            // Unreadable sources are counted as stored.
+            extrapolate(ratios, 1, ratio, size_error);
+            extrapolate(costs, 0, cost, cpu_error);
+            size += ratio;
+            cpu = cost;
+        }
+
+        result.size = static_cast<uint64_t>(size);
+        result.size_low = static_cast<uint64_t>(std::max<double>(exact, size - size_error));
+        result.size_high = static_cast<uint64_t>(size + size_error);
+        result.cpu = cpu;
+        result.cpu_low = std::max(0.0, cpu - cpu_error);
+        result.cpu_high = cpu + cpu_error;
+
+        return result;
+    }
+
     /**
      * Revert changes on the file.
      *
@@ -910,8 +7752,12 @@ public:
      */
     inline void unchange(uint64_t index)
     {
+        modifiable();
+
         if (zip_unchange(handle_.get(), index) < 0)
             throw std::runtime_error(zip_strerror(handle_.get()));
+
+        pending_.erase(index);
     }
 
     /**
@@ -921,8 +7767,12 @@ public:
      */
     inline void unchange_all()
     {
+        modifiable();
+
         if (zip_unchange_all(handle_.get()) < 0)
             throw std::runtime_error(zip_strerror(handle_.get()));
+
+        pending_.clear();
     }
 
     /**
@@ -932,6 +7782,8 @@ public:
      */
     void unchange_archive()
     {
+        modifiable();
+
         if (zip_unchange_archive(handle_.get()) < 0)
             throw std::runtime_error(zip_strerror(handle_.get()));
     }
@@ -944,6 +7796,8 @@ public:
      */
     void set_default_password(const std::string& password = "")
     {
+        modifiable();
+
         auto cstr = (password.size() > 0) ? password.c_str() : nullptr;
 
         if (zip_set_default_password(handle_.get(), cstr) < 0)
@@ -959,6 +7813,8 @@ public:
      */
     inline void set_flag(flags_t flag, int value)
     {
+        modifiable();
+
         if (zip_set_archive_flag(handle_.get(), flag, value) < 0)
             throw std::runtime_error(zip_strerror(handle_.get()));
     }
@@ -982,6 +7838,214 @@ public:
     }
 };
 
+namespace detail {
+
+/**
+ * Compare the content of two entries chunk by chunk.
+ *
+ * \param a the first archive
+ * \param i the entry in the first archive
+ * \param b the second archive
+ * \param j the entry in the second archive
+ * \param flags the open flags, e.g. ZIP_FL_COMPRESSED to compare raw data
+ * \return true if the bytes are the same
+ * \throw std::runtime_error on errors
+ */
+inline bool same_content(archive& a, uint64_t i, archive& b, uint64_t j, flags_t flags)
+{
+    auto fa = a.open(i, flags);
+    auto fb = b.open(j, flags);
+    std::vector<char> ba(65536), bb(65536);
+
+    // Reads may be short, fill the buffers to compare aligned chunks.
+    auto fill = [] (file& f, std::vector<char>& buf) {
+        std::size_t total = 0;
+
+        while (total < buf.size()) {
+            auto count = f.read(buf.data() + total, buf.size() - total);
+
+            if (count < 0)
+                throw std::runtime_error("read error");
+            if (count == 0)
+                break;
+
+            total += count;
+        }
+
+        return total;
+    };
+
+    for (;;) {
+        auto na = fill(fa, ba);
+        auto nb = fill(fb, bb);
+
+        if (na != nb || std::memcmp(ba.data(), bb.data(), na) != 0)
+            return false;
+        if (na < ba.size())
+            return true;
+    }
+}
+
+/**
+ * Get the information of an entry unless it was deleted but not written
+ * yet.
+ *
+ * \param a the archive
+ * \param index the entry index
+ * \param st the information
+ * \return false if the entry is deleted
+ */
+inline bool live_stat(archive& a, uint64_t index, libzip::stat& st)
+{
+    try {
+        st = a.stat(index);
+    } catch (const std::exception&) {
+        return false;
+    }
+
+    return true;
+}
+
+} // !detail
+
+/**
+ * Compare two archives using the metadata of their entries.
+ *
+ * Entries are matched by name then compared by size, CRC and compression
+ * method, which only reads the central directories. If verify is true,
+ * entries whose metadata match are confirmed by comparing their raw
+ * compressed bytes and, if those differ (e.g. another compression level),
+ * their uncompressed content.
+ *
+ * \param from the old archive
+ * \param to the new archive
+ * \param verify confirm the unchanged entries by reading them
+ * \return the entries of to in index order, then the removed ones
+ * \throw std::runtime_error on errors
+ */
+inline std::vector<diff_entry> diff(archive& from, archive& to, bool verify = false)
+{
+    std::unordered_map<std::string, uint64_t> names;
+    std::vector<bool> seen(from.num_entries(), true);
+    std::vector<diff_entry> result;
+    libzip::stat st;
+
+    // Entries deleted but not written yet are not part of either archive.
+    for (int64_t i = from.num_entries(); i-- > 0; ) {
+        if (detail::live_stat(from, i, st)) {
+            names[st.name] = i;
+            seen[i] = false;
+        }
+    }
+
+    for (int64_t j = 0, n = to.num_entries(); j < n; ++j) {
+        if (!detail::live_stat(to, j, st))
+            continue;
+
+        auto it = names.find(st.name);
+
+        if (it == names.end()) {
+            result.push_back({st.name, diff_kind::added, -1, j});
+            continue;
+        }
+
+        auto i = it->second;
+        auto old = from.stat(i);
+        auto same = old.size == st.size && old.crc == st.crc && old.comp_method == st.comp_method;
+
+        if (same && verify && st.size > 0)
+            same = detail::same_content(from, i, to, j, ZIP_FL_COMPRESSED) ||
+                   detail::same_content(from, i, to, j, 0);
+
+        seen[i] = true;
+        result.push_back({st.name, same ? diff_kind::unchanged : diff_kind::modified, static_cast<int64_t>(i), j});
+    }
+
+    for (std::size_t i = 0; i < seen.size(); ++i)
+        if (!seen[i])
+            result.push_back({from.stat(i).name, diff_kind::removed, static_cast<int64_t>(i), -1});
+
+    return result;
+}
+
+/**
+ * Write a patch turning an archive into a newer version of it.
+ *
+ * Entries are classified with diff. Unchanged entries are referenced by
+ * their old index and copied as raw compressed data when the patch is
+ * applied, modified entries carry a binary delta of their uncompressed
+ * content (or the whole content if the delta is not smaller) and new
+ * entries are stored whole.
+ *
+ * \param from the old archive
+ * \param to the new archive
+ * \param path the patch path
+ * \throw std::runtime_error on errors
+ * \see archive::apply_patch
+ */
+inline void make_patch(archive& from, archive& to, const std::string& path)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> fp(std::fopen(path.c_str(), "wb"), std::fclose);
+    std::string header(detail::patch_magic(), 4);
+
+    if (!fp)
+        throw std::runtime_error(std::strerror(errno));
+
+    detail::put_varint(header, from.num_entries());
+
+    auto write = [&] (const std::string& data) {
+        if (std::fwrite(data.data(), data.size(), 1, fp.get()) != 1)
+            throw std::runtime_error(std::strerror(errno));
+    };
+
+    write(header);
+
+    for (const auto& change : diff(from, to)) {
+        if (change.kind == diff_kind::removed)
+            continue;
+
+        detail::patch_record record;
+
+        record.name = change.name;
+
+        if (change.kind == diff_kind::unchanged) {
+            record.op = detail::patch_op::copy;
+            record.index = change.from;
+            record.old_crc = from.stat(change.from).crc;
+            write(detail::encode(record));
+            continue;
+        }
+
+        auto st = to.stat(change.to);
+
+        auto file = to.open(change.to);
+
+        record.op = detail::patch_op::whole;
+        record.crc = st.crc;
+        record.mtime = st.mtime;
+        record.data = detail::read_all(file, st.size);
+
+        if (change.kind == diff_kind::modified) {
+            auto old = from.stat(change.from);
+            auto old_file = from.open(change.from);
+            auto delta = detail::make_delta(detail::read_all(old_file, old.size), record.data);
+
+            if (delta.size() < record.data.size()) {
+                record.op = detail::patch_op::delta;
+                record.index = change.from;
+                record.old_crc = old.crc;
+                record.data = std::move(delta);
+            }
+        }
+
+        write(detail::encode(record));
+    }
+
+    // Closing flushes the buffered end of the patch.
+    if (std::fclose(fp.release()) != 0)
+        throw std::runtime_error(std::strerror(errno));
+}
+
 } // !libzip
 
 #endif // !ZIP_HPP